@@ -35,9 +35,17 @@ check_md5sum() {
     fi
 }
 
+check_encoding() {
+    encoding=$(awk 'tolower($1) == "content-encoding:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    if [ "$encoding" != "$1" ]; then
+	echo "FAILURE: content-encoding: $encoding != $1" > $WORKSPACE/test
+	return 1;
+    fi
+}
+
 check_header() {
     status=$(head -n 1 $WORKSPACE/header | tr -d '\r\n')
-    content=$(awk '/Content/ { print $2 }' $WORKSPACE/header | tr -d '\r\n')
+    content=$(awk 'tolower($1) == "content-type:" { print $2 }' $WORKSPACE/header | tr -d '\r\n')
     if [ "$status" != "$1" ]; then
 	echo "FAILURE: $status != $1" > $WORKSPACE/test
 	return 1;
@@ -115,7 +123,7 @@ printf "\n %-64s ... \n" "Handle Browse Requests"
 
 printf "     %-60s ... " "/"
 HREFS="/..,/html,/scripts,/song.txt,/text"
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/ > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all ".. html scripts text" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
@@ -127,9 +135,9 @@ fi
 sleep 2
 
 printf "     %-60s ... " "/html"
-HREFS="/html/..,/html/index.html"
+HREFS="/html/..,/html/index.html,/html/index.html.br"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html > $WORKSPACE/test
-if ! check_status $? 0 || ! grep_all ".. index.html" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
+if ! check_status $? 0 || ! grep_all ".. index.html index.html.br" $WORKSPACE/test || ! check_hrefs $HREFS || ! check_header "$STATUS" "$CONTENT"; then
     error "Failure"
 else
     echo "Success"
@@ -163,7 +171,7 @@ printf "\n %-64s ... \n" "Handle File Requests"
 
 printf "     %-60s ... " "/html/index.html"
 MD5SUM=36fcc1da4afe58242350ee3940bb4220
-STATUS="HTTP/1.0 200 OK"
+STATUS="HTTP/1.1 200 OK"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/html/index.html > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "Spidey html thumbnail" $WORKSPACE/test || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT"; then
@@ -210,9 +218,38 @@ sleep 2
 
 # ------------------------------------------------------------------------------
 
+printf "\n %-64s ... \n" "Handle Encoded Requests"
+
+printf "     %-60s ... " "/html/index.html (br sidecar)"
+MD5SUM=b32caf06b015834eaac3e93ac2f43e43
+STATUS="HTTP/1.1 200 OK"
+CONTENT="text/html"
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: br" $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! check_encoding "br"; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+printf "     %-60s ... " "/html/index.html (identity)"
+MD5SUM=36fcc1da4afe58242350ee3940bb4220
+curl -s -D $WORKSPACE/header -H "Accept-Encoding: identity" $HOST:$PORT/html/index.html > $WORKSPACE/test
+if ! check_status $? 0 || ! check_md5sum $MD5SUM || ! check_header "$STATUS" "$CONTENT" || ! check_encoding ""; then
+    error "Failure"
+else
+    echo "Success"
+fi
+
+sleep 2
+
+# ------------------------------------------------------------------------------
+
 printf "\n %-64s ... \n" "Handle CGI Requests"
 
 printf "     %-60s ... " "/scripts/env.sh"
+STATUS="HTTP/1.0 200 OK"
 CONTENT="text/plain"
 HEADERS="DOCUMENT_ROOT QUERY_STRING REMOTE_ADDR REMOTE_PORT REQUEST_METHOD REQUEST_URI SCRIPT_FILENAME SERVER_PORT HTTP_HOST HTTP_USER_AGENT"
 curl -s -D $WORKSPACE/header $HOST:$PORT/scripts/env.sh > $WORKSPACE/test
@@ -265,7 +302,7 @@ sleep 2
 printf "\n %-64s ... \n" "Handle Errors"
 
 printf "     %-60s ... " "/asdf"
-STATUS="HTTP/1.0 404 Not Found"
+STATUS="HTTP/1.1 404 Not Found"
 CONTENT="text/html"
 curl -s -D $WORKSPACE/header $HOST:$PORT/asdf > $WORKSPACE/test
 if ! check_status $? 0 || ! grep_all "404" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -277,7 +314,7 @@ fi
 sleep 2
 
 printf "     %-60s ... " "Bad Request"
-STATUS="HTTP/1.0 400 Bad Request"
+STATUS="HTTP/1.1 400 Bad Request"
 CONTENT="text/html"
 nc $HOST $PORT <<<"DERP" |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
 if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -289,7 +326,7 @@ fi
 sleep 2
 
 printf "     %-60s ... " "Bad Headers"
-STATUS="HTTP/1.0 400 Bad Request"
+STATUS="HTTP/1.1 400 Bad Request"
 CONTENT="text/html"
 printf "GET / HTTP/1.0\r\nHost\r\n" | nc $HOST $PORT |& tee $WORKSPACE/test $WORKSPACE/header > /dev/null
 if ! check_status $? 0 || ! grep_all "400" $WORKSPACE/test || ! check_header "$STATUS" "$CONTENT"; then
@@ -3,15 +3,27 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <arpa/inet.h>
+#include <net/if.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Constants */
 
-#define WHITESPACE	" \t\n"
+#define WHITESPACE	" \t\r\n"
+#define KEEPALIVE_TIMEOUT   5           /* Seconds to wait for next request on a connection */
+#define REQUEST_TIMEOUT     10          /* Seconds to receive a whole request once it starts */
+#define SEND_TIMEOUT        10          /* Seconds a response may go without sending SEND_RATE_MIN per second */
+#define SEND_RATE_MIN       1024        /* Fewest bytes per second a client must accept */
 
 /**
  * Concurrency modes
@@ -19,6 +31,11 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    EPOLL,                              /**< Event loop over non-blocking connections */
+    THREADED,                           /**< Fixed pool of worker threads */
+    PREFORK,                            /**< Fixed pool of worker processes */
+    URING,                              /**< Asynchronous I/O through io_uring */
+    SHARDED,                            /**< Event loop per CPU with work stealing */
     UNKNOWN
 } ServerMode;
 
@@ -28,6 +45,14 @@ extern char *Port;                      /**< Port number */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern size_t Workers;                  /**< Number of workers (0 for mode default) */
+extern size_t MaxConnections;           /**< Most clients served at once (0 for unbounded) */
+extern size_t FileCacheEntries;         /**< Most files kept open by file cache (0 to disable) */
+extern time_t FileCacheValidity;        /**< Seconds file cache trusts an entry (unless RootPath is watched) */
+extern size_t ContentCacheBytes;        /**< Most file bytes held in memory (0 to disable) */
+extern size_t ContentCacheFileMax;      /**< Largest file held in memory */
+extern int CompressLevel;               /**< Level of on-the-fly compression (0 to disable) */
+extern size_t CompressMinSize;          /**< Smallest body compressed on the fly */
 
 /* Logging Macros */
 
@@ -40,33 +65,345 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Arena Allocator */
+
+#define ARENA_BLOCK_SIZE    4096        /* Smallest block allocated by an arena */
+
+typedef struct arena_block ArenaBlock;
+struct arena_block {
+    ArenaBlock  *next;                  /*< Previously allocated block */
+    size_t       capacity;              /*< Number of bytes in data */
+    char         data[];                /*< Memory handed out by arena */
+};
+
+typedef struct {
+    ArenaBlock  *head;                  /*< Block allocations are bumped from */
+    size_t       used;                  /*< Number of head bytes handed out */
+} Arena;
+
+void *      arena_alloc(Arena *arena, size_t size);
+char *      arena_strdup(Arena *arena, const char *s);
+char *      arena_printf(Arena *arena, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void        arena_reset(Arena *arena);
+void        arena_free(Arena *arena);
+
+/* Timer Wheel */
+
+#define TIMER_TICK_MS       10          /* Milliseconds per tick of timer wheel */
+#define TIMER_LEVEL_BITS    6           /* Bits of tick resolved by each level */
+#define TIMER_SLOTS         (1 << TIMER_LEVEL_BITS)     /* Slots per level */
+#define TIMER_LEVELS        4           /* Levels of wheel (spanning 2^24 ticks) */
+
+typedef struct timer Timer;
+struct timer {
+    Timer       *prev;                  /*< Previous timer in slot */
+    Timer       *next;                  /*< Next timer in slot (or expired list) */
+    uint64_t     expires;               /*< Tick timer expires at */
+    unsigned     level;                 /*< Level of slot holding timer */
+    unsigned     slot;                  /*< Index of slot holding timer */
+    bool         pending;               /*< Whether timer is in wheel */
+    void        *data;                  /*< Object timer belongs to */
+};
+
+typedef struct {
+    Timer       *slots[TIMER_LEVELS][TIMER_SLOTS]; /*< Timers by level and slot */
+    uint64_t     occupied[TIMER_LEVELS]; /*< Bit per non-empty slot of each level */
+    uint64_t     current;               /*< Next tick to expire */
+    size_t       count;                 /*< Number of pending timers */
+} TimerWheel;
+
+uint64_t    timer_now(void);
+void        timer_wheel_init(TimerWheel *w, uint64_t now);
+void        timer_add(TimerWheel *w, Timer *t, uint64_t now, uint64_t timeout);
+void        timer_cancel(TimerWheel *w, Timer *t);
+void        timer_resume(TimerWheel *w, Timer *t);
+Timer *     timer_wheel_expire(TimerWheel *w, uint64_t now);
+int         timer_wheel_timeout(TimerWheel *w, uint64_t now);
+
+/* Socket Buffer */
+
+typedef struct {
+    char        *data;                  /*< Allocated bytes (NULL until first reserve) */
+    size_t       offset;                /*< Number of bytes consumed from front */
+    size_t       length;                /*< Number of bytes committed */
+    size_t       capacity;              /*< Allocated size of data */
+    size_t       limit;                 /*< Most bytes data may grow to (0 for unbounded) */
+} Buffer;
+
+char *      buffer_reserve(Buffer *b, size_t size);
+void        buffer_commit(Buffer *b, size_t size);
+char *      buffer_peek(Buffer *b, size_t *size);
+void        buffer_consume(Buffer *b, size_t size);
+void        buffer_compact(Buffer *b);
+int         buffer_append(Buffer *b, const struct iovec *segments, size_t nsegments);
+ssize_t     buffer_fill(Buffer *b, int fd);
+int         buffer_flush(Buffer *b, int fd, int flags);
+void        buffer_free(Buffer *b);
+
+/* Root Watcher */
+
+#define WATCH_SUBSCRIBERS_MAX   8       /* Most caches subscribed to changes */
+#define WATCH_QUIET_MS          50      /* Changes are posted once none arrive for this long */
+#define WATCH_DELAY_MAX_MS      1000    /* ... or once the oldest of them is this old */
+#define WATCH_BATCH_MAX         1024    /* Most paths in one batch (more posts the whole root) */
+
+typedef void (*WatchHandler)(const char *path, bool recursive, void *arg);
+
+int         watch_subscribe(const char *prefix, WatchHandler handler, void *arg);
+int         watch_start(const char *root);
+bool        watch_active(void);
+
+/* Content Encoding */
+
+typedef enum {
+    ENCODING_BROTLI,                    /*< br (.br sidecar) */
+    ENCODING_ZSTD,                      /*< zstd (.zst sidecar) */
+    ENCODING_GZIP,                      /*< gzip (.gz sidecar) */
+    ENCODING_IDENTITY,                  /*< Negotiated, but sent as is */
+    ENCODING_NONE,                      /*< Not negotiable (no Vary header) */
+} Encoding;
+
+#define ENCODINGS           ENCODING_IDENTITY   /* Number of compressed encodings */
+
+Encoding    encoding_negotiate(const char *accept, unsigned available);
+const char *encoding_suffix(Encoding encoding);
+bool        encoding_sidecar(const char *path);
+
+/* File Cache */
+
+#define FILE_CACHE_ENTRIES  256         /* Default most files kept open */
+#define FILE_CACHE_VALIDITY 5           /* Default seconds an entry is trusted */
+#define CONTENT_CACHE_BYTES (16 << 20)  /* Default most file bytes held in memory */
+#define CONTENT_CACHE_FILE_MAX (32 << 10) /* Default largest file held in memory */
+
+typedef enum {
+    HANDLER_FILE,                       /*< Readable file sent as is */
+    HANDLER_BROWSE,                     /*< Directory listed in HTML */
+    HANDLER_CGI,                        /*< Executable run as CGI script */
+    HANDLER_ERROR,                      /*< Neither readable nor executable */
+} Handler;
+
+typedef struct file_cache FileCache;
+
+typedef struct file_entry FileEntry;
+struct file_entry {
+    FileCache   *cache;                 /*< Cache entry belongs to (and whose lock guards it) */
+    FileEntry   *hash_next;             /*< Next entry in hash bucket */
+    FileEntry   *lru_prev;              /*< More recently used entry */
+    FileEntry   *lru_next;              /*< Less recently used entry */
+    uint64_t     hash;                  /*< Hash of uri */
+    time_t       loaded;                /*< When entry was loaded (monotonic seconds) */
+    size_t       refs;                  /*< References held by cache and requests */
+    bool         cached;                /*< Whether entry is still in cache */
+
+    Handler      handler;               /*< How requests for path are handled */
+    int          fd;                    /*< Open file (HANDLER_FILE without content only, or -1) */
+    struct stat  st;                    /*< Metadata of path */
+    char        *path;                  /*< Real path corresponding to uri (in entry) */
+    unsigned     encodings;             /*< Sidecars next to file (bit per Encoding) */
+    bool         compressible;          /*< Whether file is compressed on the fly (without sidecars) */
+    unsigned     compressing;           /*< Variants being compressed (bit per Encoding) */
+    char        *variants[ENCODINGS];   /*< Compressed file bytes by Encoding (or NULL) */
+    size_t       variant_lengths[ENCODINGS]; /*< Number of bytes in each variant */
+    char        *content;               /*< File bytes or rendered listing, followed by headers (or NULL) */
+    size_t       content_length;        /*< Number of bytes in content (without headers) */
+    char        *headers;               /*< Rendered Content-Type and Content-Length (in content) */
+    size_t       headers_length;        /*< Number of bytes in headers */
+    char         uri[];                 /*< Requested URI */
+};
+
+FileCache * file_cache_create(size_t shares);
+void        file_cache_use(FileCache *cache);
+FileEntry * file_cache_find(const char *uri);
+FileEntry * file_cache_get(const char *uri);
+void        file_cache_retain(FileEntry *entry);
+void        file_cache_release(FileEntry *entry);
+void        file_cache_invalidate(const char *path, bool recursive, void *arg);
+const char *file_cache_variant(FileEntry *entry, Encoding encoding, size_t *length);
+bool        file_cache_claim(FileEntry *entry, Encoding encoding);
+bool        file_cache_store(FileEntry *entry, Encoding encoding, char *data, size_t length);
+const char *file_cache_content(FileEntry *entry);
+bool        file_cache_store_content(FileEntry *entry, char *content, size_t length, size_t headers_length);
+
+/* Content Compression */
+
+#define COMPRESS_LEVEL      6           /* Default level of on-the-fly compression */
+#define COMPRESS_MIN_SIZE   1024        /* Default smallest body compressed */
+#define COMPRESS_INLINE_MAX (64 << 10)  /* Largest body compressed by the thread serving it */
+#define COMPRESS_FILE_MAX   (8 << 20)   /* Largest file compressed at all */
+#define COMPRESS_WORKERS    2           /* Threads compressing larger files */
+#define COMPRESS_QUEUE_SIZE 64          /* Most files waiting to be compressed */
+#define COMPRESS_ENCODINGS  ((1 << ENCODING_BROTLI) | (1 << ENCODING_GZIP)) /* Encodings compressed on the fly */
+
+bool        compress_eligible(const char *mimetype, size_t length);
+char *      compress_data(Encoding encoding, const void *data, size_t length, size_t *clength);
+char *      compress_entry(FileEntry *entry, Encoding encoding, size_t *clength);
+void        compress_queue(FileEntry *entry, Encoding encoding);
+
 /* HTTP Request */
 
+#define REQUEST_MAX         BUFSIZ      /* Most bytes in one request (and its read buffer) */
+#define REQUEST_HEADERS_MAX 16          /* Most unknown headers accepted in one request */
+#define REQUEST_HOST_MAX    (INET6_ADDRSTRLEN + IF_NAMESIZE)    /* Numeric IPv6 address with scope */
+#define REQUEST_PORT_MAX    sizeof("65535")
+
 typedef struct header Header;
 struct header {
-    char    *name;                      /*< Name of header entry */
-    char    *value;                     /*< Value of header entry */
-    Header  *next;                      /*< Next header entry */
+    char    *name;                      /*< Name of header entry (in request buffer) */
+    size_t   name_length;               /*< Length of name */
+    char    *value;                     /*< Value of header entry (in request buffer) */
+    size_t   value_length;              /*< Length of value */
 };
 
+typedef enum {
+    HEADER_ACCEPT,                      /*< Accept */
+    HEADER_ACCEPT_ENCODING,             /*< Accept-Encoding */
+    HEADER_ACCEPT_LANGUAGE,             /*< Accept-Language */
+    HEADER_AUTHORIZATION,               /*< Authorization */
+    HEADER_CACHE_CONTROL,               /*< Cache-Control */
+    HEADER_CONNECTION,                  /*< Connection */
+    HEADER_CONTENT_LENGTH,              /*< Content-Length */
+    HEADER_CONTENT_TYPE,                /*< Content-Type */
+    HEADER_COOKIE,                      /*< Cookie */
+    HEADER_HOST,                        /*< Host */
+    HEADER_IF_MODIFIED_SINCE,           /*< If-Modified-Since */
+    HEADER_IF_NONE_MATCH,               /*< If-None-Match */
+    HEADER_RANGE,                       /*< Range */
+    HEADER_REFERER,                     /*< Referer */
+    HEADER_UPGRADE_INSECURE_REQUESTS,   /*< Upgrade-Insecure-Requests */
+    HEADER_USER_AGENT,                  /*< User-Agent */
+    HEADER_FIELDS,                      /*< Number of well-known headers */
+    HEADER_UNKNOWN = HEADER_FIELDS,     /*< Any other header */
+} HeaderField;
+
+typedef enum {
+    PARSER_METHOD,                      /*< Reading method */
+    PARSER_URI_START,                   /*< Skipping spaces before URI */
+    PARSER_URI,                         /*< Reading URI and query */
+    PARSER_VERSION_START,               /*< Skipping spaces before version */
+    PARSER_VERSION,                     /*< Reading version */
+    PARSER_REQUEST_LF,                  /*< Expecting LF after request line */
+    PARSER_HEADER_START,                /*< Expecting header or empty line */
+    PARSER_HEADER_NAME,                 /*< Reading header name */
+    PARSER_VALUE_START,                 /*< Skipping spaces before header value */
+    PARSER_VALUE,                       /*< Reading header value */
+    PARSER_HEADER_LF,                   /*< Expecting LF after header */
+    PARSER_END_LF,                      /*< Expecting LF after empty line */
+    PARSER_DONE,                        /*< Request parsed */
+    PARSER_ERROR,                       /*< Request malformed or too large */
+} ParserState;
+
+typedef struct {
+    ParserState state;                  /*< Position in request grammar */
+    size_t      offset;                 /*< Number of request buffer bytes scanned */
+    size_t      mark;                   /*< Offset where current token starts */
+    size_t      end;                    /*< Offset where current value ends (without trailing spaces) */
+    Header     *header;                 /*< Header whose value is being read */
+} Parser;
+
+#define RESPONSE_SEGMENTS_MAX   8       /* Most segments in one response */
+
+typedef struct {
+    struct iovec segments[RESPONSE_SEGMENTS_MAX]; /*< Status line, header, and body segments */
+    size_t   nsegments;                 /*< Number of segments */
+    size_t   length;                    /*< Number of bytes in segments */
+    char     content_length[24];        /*< Formatted Content-Length (end aligned) */
+} Response;
+
+typedef struct connection Connection;
+
+typedef struct {
+    int         fd;                     /*< File sent after buffered response (or -1) */
+    off_t       offset;                 /*< Offset of next file byte to send */
+    size_t      length;                 /*< Number of file bytes left to send */
+    FileEntry  *entry;                  /*< File cache entry owning fd (NULL if body owns it) */
+} Body;
+
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
-    char    *method;                    /*< HTTP method */
-    char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
-    char    *query;                     /*< HTTP query string */
+    char    *method;                    /*< HTTP method (in request buffer) */
+    char    *uri;                       /*< HTTP uniform resource identifier (in request buffer) */
+    char    *path;                      /*< Real path corrsponding to URI and RootPath (in entry, or NULL until dispatched) */
+    char    *query;                     /*< HTTP query string (in request buffer) */
+
+    char     host[REQUEST_HOST_MAX];    /*< Numeric address of client */
+    char     port[REQUEST_PORT_MAX];    /*< Port number of client */
+
+    Header   fields[HEADER_FIELDS];     /*< Well-known headers indexed by HeaderField */
+    unsigned present;                   /*< Bit per HeaderField set in fields */
+    Header   headers[REQUEST_HEADERS_MAX]; /*< Other headers (and repeats) in arrival order */
+    size_t   nheaders;                  /*< Number of other headers */
+    bool     keepalive;                 /*< Whether connection persists after response */
 
-    char     host[NI_MAXHOST];          /*< Host name of client */
-    char     port[NI_MAXSERV];          /*< Port number of client */
+    Connection *connection;             /*< Event loop connection of request (NULL if blocking) */
+    FileEntry *entry;                   /*< File cache entry of path (or NULL) */
+    Response response;                  /*< Response being built by handler */
+    Body     body;                      /*< File sent after buffered response */
 
-    Header  *headers;                   /*< List of name, value Header pairs */
+    size_t   rrequest;                  /*< Number of input bytes in parsed request */
+    Parser   parser;                    /*< Incremental parser state over input */
+
+    Buffer   input;                     /*< Bytes received from client (never moves) */
+    Buffer   output;                    /*< Response bytes not yet sent to client */
+    Arena    arena;                     /*< Allocations released when request is reset */
 } Request;
 
+Request *   create_request(int fd, struct sockaddr *addr, socklen_t addrlen);
 Request *   accept_request(int sfd);
 void	    free_request(Request *request);
+void	    reset_request(Request *request);
+bool	    next_request(Request *request);
+int	    send_body(int fd, Body *body);
+void	    close_body(Body *body);
 int	    parse_request(Request *request);
 
+/* HTTP Parser */
+
+int         parser_execute(Request *request);
+HeaderField header_field(const char *name, size_t length);
+const char *header_name(HeaderField field);
+const char *header_cgi_variable(HeaderField field);
+const char *request_header(Request *request, HeaderField field);
+
+/* Delimiter Scanning */
+
+#define SCAN_SET_MAX    4               /* Most delimiters scanned for at once */
+
+typedef size_t (*ScanFunction)(const char *s, size_t length, const char *set);
+
+size_t      scan_delimiters(const char *s, size_t length, const char *set);
+ScanFunction scan_kernel(const char *name);
+int         scan_select(const char *name);
+
+/* Buffered Connection */
+
+typedef enum {
+    CONNECTION_READING,                 /*< Buffering request from client */
+    CONNECTION_HANDLING,                /*< Queued for or running handler */
+    CONNECTION_WRITING,                 /*< Sending buffered response to client */
+    CONNECTION_CONTINUING,              /*< Queued to send more of its file body */
+} ConnectionState;
+
+struct connection {
+    Request        *request;            /*< HTTP request on this connection */
+    ConnectionState state;              /*< Position in read/parse/write cycle */
+    void           *owner;              /*< Event loop the client socket belongs to */
+    Connection     *next;               /*< Next connection in event loop work list */
+    Timer           timer;              /*< Idle, request, or send timeout in event loop */
+    size_t          sent;               /*< Bytes sent since send timer was armed */
+
+    bool            eof;                /*< Whether client has shut down writing */
+    bool            persist;            /*< Whether connection reads another request once sent */
+
+    Body            body;               /*< File sent after request output */
+};
+
+Connection *connection_create(int fd, struct sockaddr *addr, socklen_t addrlen);
+void        connection_free(Connection *c);
+bool        connection_ready(Connection *c);
+bool        connection_next(Connection *c);
+void        connection_handle(Connection *c);
+
 /* HTTP Request Handlers */
 
 typedef enum {
@@ -74,26 +411,112 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_BAD_GATEWAY,		/* 502 Bad Gateway */
 } Status;
 
 Status      handle_request(Request *request);
+Status      dispatch_request(Request *request);
+Status      handle_error(Request *request, Status status);
+
+/* HTTP Response */
+
+void        response_start(Request *request, Status status, const char *mimetype, size_t length);
+void        response_append(Request *request, const void *data, size_t length);
+void        response_attach(Request *request, int fd, size_t length);
+void        response_attach_entry(Request *request, FileEntry *entry);
+void        response_start_entry(Request *request, FileEntry *entry);
+void        response_start_encoded(Request *request, Status status, const char *mimetype, size_t length, Encoding encoding);
+size_t      response_headers(char *buffer, size_t size, const char *mimetype, size_t length, Encoding encoding);
+int         response_send(Request *request);
+int         response_flush(Request *request);
+int         response_more(const Body *body);
 
 /* HTTP Server */
 
 int         single_server(int sfd);
 int         forking_server(int sfd);
+int         epoll_server(int sfd);
+int         threaded_server(int sfd);
+int         prefork_server(const char *port);
+int         uring_server(int sfd);
+int         sharded_server(const char *port);
+
+/* Work Queue */
+
+typedef struct {
+    void          **items;              /*< Circular buffer of queued items */
+    size_t          capacity;           /*< Maximum number of queued items */
+    size_t          head;               /*< Index of oldest queued item */
+    size_t          size;               /*< Number of queued items */
+
+    pthread_mutex_t lock;               /*< Protects queue fields */
+    pthread_cond_t  not_empty;          /*< Signaled when an item is pushed */
+    pthread_cond_t  not_full;           /*< Signaled when an item is popped */
+} Queue;
+
+int         queue_init(Queue *q, size_t capacity);
+void        queue_destroy(Queue *q);
+void        queue_push(Queue *q, void *item);
+bool        queue_try_push(Queue *q, void *item);
+void *      queue_pop(Queue *q);
+
+/* Object Pool */
+
+#define POOL_ALIGNMENT      64          /* Cache line size objects are padded to */
+#define POOL_SLAB_OBJECTS   16          /* Objects allocated at once */
+
+typedef struct pool_object PoolObject;
+struct pool_object {
+    PoolObject     *next;               /*< Next free object (overlays object while free) */
+};
+
+typedef struct {
+    const char     *name;               /*< Name of pool (for logging) */
+    size_t          size;               /*< Size of each object */
+    PoolObject     *free;               /*< Free list of recycled objects */
+    size_t          allocated;          /*< Number of objects in slabs */
+    size_t          in_use;             /*< Number of objects handed out */
+    size_t          peak;               /*< Most objects handed out at once */
+    size_t          exhausted;          /*< Number of times pool_get failed */
+    pthread_mutex_t lock;               /*< Protects pool fields */
+} Pool;
+
+typedef struct {
+    size_t          in_use;             /*< Number of objects handed out */
+    size_t          peak;               /*< Most objects handed out at once */
+    size_t          allocated;          /*< Number of objects in slabs */
+    size_t          capacity;           /*< Most objects allowed (0 for unbounded) */
+    size_t          exhausted;          /*< Number of times pool_get failed */
+} PoolCounters;
+
+#define POOL_INITIALIZER(n, s)  {.name = (n), .size = (s), .lock = PTHREAD_MUTEX_INITIALIZER}
+
+extern Pool RequestPool;                /**< Pool of Request structures */
+extern Pool ConnectionPool;             /**< Pool of Connection structures */
+
+void *      pool_get(Pool *p);
+void        pool_put(Pool *p, void *object);
+void        pool_counters(Pool *p, PoolCounters *counters);
+void        pool_log(Pool *p);
+void        pool_report(int signum);
+
+/* Mime Types */
+
+int         mimetypes_load(void);
+void        mimetypes_reload(int signum);
+void        mimetypes_refresh(void);
+const char *determine_mimetype(const char *path);
 
 /* Socket */
 
-int	    socket_listen(const char *port);
+int	    socket_listen(const char *port, bool reuseport);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	    determine_mimetype(const char *path);
-char *	    determine_request_path(const char *uri);
+char *	    determine_request_path(const char *uri, char *buffer);
 const char *http_status_string(Status status);
 char *	    skip_nonwhitespace(char *s);
 char *	    skip_whitespace(char *s);
@@ -0,0 +1,118 @@
+/* arena.c: Per-Request Arena Allocator */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* Constants */
+
+#define ARENA_ALIGNMENT     (sizeof(void *) * 2)
+
+/* Arena Functions */
+
+/**
+ * Allocate memory from arena.
+ *
+ * @param   arena       Arena structure.
+ * @param   size        Number of bytes to allocate.
+ * @return  Pointer to uninitialized memory (or NULL on error).
+ *
+ * Memory is bumped off the newest block; when it does not fit, a new block
+ * of at least ARENA_BLOCK_SIZE bytes is pushed.  The memory is only released
+ * by arena_reset or arena_free.
+ **/
+void * arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->head;
+    if (!block || block->capacity - arena->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (!block) {
+            fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        block->next     = arena->head;
+        block->capacity = capacity;
+        arena->head     = block;
+        arena->used     = 0;
+    }
+
+    void *pointer = block->data + arena->used;
+    arena->used += size;
+    return pointer;
+}
+
+/**
+ * Copy string into arena.
+ *
+ * @param   arena       Arena structure.
+ * @param   s           String to copy.
+ * @return  Copy of string in arena (or NULL on error).
+ **/
+char * arena_strdup(Arena *arena, const char *s) {
+    size_t length = strlen(s) + 1;
+    char  *copy   = arena_alloc(arena, length);
+
+    return copy ? memcpy(copy, s, length) : NULL;
+}
+
+/**
+ * Format string into arena.
+ *
+ * @param   arena       Arena structure.
+ * @param   format      printf(3) format string.
+ * @return  Formatted string in arena (or NULL on error).
+ **/
+char * arena_printf(Arena *arena, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *s = length < 0 ? NULL : arena_alloc(arena, length + 1);
+    if (!s) {
+        return NULL;
+    }
+
+    va_start(args, format);
+    vsnprintf(s, length + 1, format, args);
+    va_end(args);
+    return s;
+}
+
+/**
+ * Release all allocations from arena for reuse.
+ *
+ * @param   arena       Arena structure.
+ *
+ * The oldest block is kept, so a request that fits in it neither allocates
+ * nor frees; blocks pushed for larger requests are freed.
+ **/
+void arena_reset(Arena *arena) {
+    while (arena->head && arena->head->next) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+
+    arena->used = 0;
+}
+
+/**
+ * Free every block of arena.
+ *
+ * @param   arena       Arena structure.
+ **/
+void arena_free(Arena *arena) {
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,195 @@
+/* buffer.c: Socket Buffer Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+/* Buffer Functions */
+
+/**
+ * Reserve room for bytes at end of buffer.
+ *
+ * @param   b           Buffer structure.
+ * @param   size        Number of bytes to make room for.
+ * @return  Pointer to free bytes after length (or NULL on error).
+ *
+ * The buffer doubles from BUFSIZ until it fits, up to its limit.  Data moves
+ * when the buffer grows, so pointers into it are only valid until the next
+ * reserve (a buffer whose limit it starts at never moves).
+ **/
+char * buffer_reserve(Buffer *b, size_t size) {
+    if (b->length + size <= b->capacity) {
+        return b->data + b->length;
+    }
+
+    size_t capacity = b->capacity ? b->capacity : BUFSIZ;
+    while (capacity < b->length + size) {
+        capacity *= 2;
+    }
+    if (b->limit && capacity > b->limit) {
+        capacity = b->limit;
+    }
+    if (capacity < b->length + size) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    char *data = realloc(b->data, capacity);
+    if (!data) {
+        return NULL;
+    }
+
+    b->data     = data;
+    b->capacity = capacity;
+    return b->data + b->length;
+}
+
+/**
+ * Add reserved bytes to buffer once they are written.
+ *
+ * @param   b           Buffer structure.
+ * @param   size        Number of bytes written after length.
+ **/
+void buffer_commit(Buffer *b, size_t size) {
+    b->length += size;
+}
+
+/**
+ * Look at unconsumed bytes of buffer.
+ *
+ * @param   b           Buffer structure.
+ * @param   size        Number of unconsumed bytes (set).
+ * @return  Pointer to first unconsumed byte.
+ **/
+char * buffer_peek(Buffer *b, size_t *size) {
+    *size = b->length - b->offset;
+    return b->data + b->offset;
+}
+
+/**
+ * Mark bytes at front of buffer as consumed.
+ *
+ * @param   b           Buffer structure.
+ * @param   size        Number of bytes consumed.
+ *
+ * Once every byte is consumed, the buffer starts over from the front.
+ **/
+void buffer_consume(Buffer *b, size_t size) {
+    b->offset += size;
+    if (b->offset == b->length) {
+        b->offset = b->length = 0;
+    }
+}
+
+/**
+ * Move unconsumed bytes to front of buffer.
+ *
+ * @param   b           Buffer structure.
+ **/
+void buffer_compact(Buffer *b) {
+    if (b->offset > 0) {
+        memmove(b->data, b->data + b->offset, b->length - b->offset);
+        b->length -= b->offset;
+        b->offset  = 0;
+    }
+}
+
+/**
+ * Gather segments at end of buffer.
+ *
+ * @param   b           Buffer structure.
+ * @param   segments    Segments to append.
+ * @param   nsegments   Number of segments.
+ * @return  -1 on error and 0 on success.
+ **/
+int buffer_append(Buffer *b, const struct iovec *segments, size_t nsegments) {
+    size_t size = 0;
+    for (size_t i = 0; i < nsegments; i++) {
+        size += segments[i].iov_len;
+    }
+
+    char *space = buffer_reserve(b, size);
+    if (!space) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < nsegments; i++) {
+        memcpy(space, segments[i].iov_base, segments[i].iov_len);
+        space += segments[i].iov_len;
+    }
+
+    buffer_commit(b, size);
+    return 0;
+}
+
+/**
+ * Receive bytes from socket into free space of buffer.
+ *
+ * @param   b           Buffer structure.
+ * @param   fd          Socket file descriptor.
+ * @return  Number of bytes received, 0 on end of file, or -1 on error (with
+ * errno EAGAIN if a non-blocking socket has nothing, or ENOBUFS if the buffer
+ * is at its limit).
+ **/
+ssize_t buffer_fill(Buffer *b, int fd) {
+    if (!buffer_reserve(b, 1)) {
+        return -1;
+    }
+
+    ssize_t nread;
+    do {
+        nread = recv(fd, b->data + b->length, b->capacity - b->length, 0);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread > 0) {
+        buffer_commit(b, nread);
+    }
+    return nread;
+}
+
+/**
+ * Send unconsumed bytes of buffer to socket.
+ *
+ * @param   b           Buffer structure.
+ * @param   fd          Socket file descriptor.
+ * @param   flags       Flags for send (MSG_NOSIGNAL is always added).
+ * @return  -1 on error, 0 if more remains to be sent, 1 once buffer is empty.
+ *
+ * On a blocking socket, this only returns once everything is sent; on a
+ * non-blocking socket, it returns 0 once the socket is full.
+ **/
+int buffer_flush(Buffer *b, int fd, int flags) {
+    while (b->offset < b->length) {
+        ssize_t nsent = send(fd, b->data + b->offset, b->length - b->offset, flags | MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            debug("send failed: %s", strerror(errno));
+            return -1;
+        }
+
+        buffer_consume(b, nsent);
+    }
+
+    return 1;
+}
+
+/**
+ * Free memory of buffer, leaving it empty.
+ *
+ * @param   b           Buffer structure.
+ **/
+void buffer_free(Buffer *b) {
+    free(b->data);
+    b->data     = NULL;
+    b->offset   = b->length = b->capacity = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
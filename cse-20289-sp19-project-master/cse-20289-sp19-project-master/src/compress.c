@@ -0,0 +1,383 @@
+/* compress.c: On-the-fly Content Compression */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+/* Constants */
+
+#define COMPRESS_CHUNK      (64 << 10)  /* Bytes fed to or taken from an encoder at once */
+#define GZIP_WINDOW_BITS    (15 + 16)   /* Largest deflate window, wrapped in a gzip header */
+#define BROTLI_WINDOW_BITS  22          /* Brotli window (its default) */
+
+/* Mimetype prefixes and suffixes of compressible content */
+static const char *CompressiblePrefixes[] = {"text/", NULL};
+static const char *CompressibleSuffixes[] = {"javascript", "json", "xml", "wasm", NULL};
+
+/* Compression Stream */
+
+typedef struct {
+    Encoding            encoding;       /*< Encoding produced */
+    z_stream            zstream;        /*< Deflate state (ENCODING_GZIP) */
+    BrotliEncoderState *brotli;         /*< Encoder state (ENCODING_BROTLI) */
+} CompressStream;
+
+/* Compression Workers */
+
+typedef struct {
+    FileEntry  *entry;                  /*< File being compressed (referenced) */
+    Encoding    encoding;               /*< Encoding being produced */
+} CompressJob;
+
+typedef struct {
+    pthread_mutex_t lock;               /*< Protects starting workers */
+    pid_t           pid;                /*< Process workers were started in (or 0) */
+    Queue           queue;              /*< Jobs waiting for a worker */
+} CompressWorkers;
+
+static CompressWorkers Compressors = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Internal Functions */
+
+/**
+ * Start compression stream.
+ *
+ * @param   s           CompressStream structure.
+ * @param   encoding    Encoding to produce (in COMPRESS_ENCODINGS).
+ * @param   length      Number of bytes that will be compressed.
+ * @return  -1 on error and 0 on success.
+ *
+ * CompressLevel is a gzip level (1 to 9), which is also a reasonable brotli
+ * quality.
+ **/
+static int compress_stream_init(CompressStream *s, Encoding encoding, size_t length) {
+    memset(s, 0, sizeof(CompressStream));
+    s->encoding = encoding;
+
+    switch (encoding) {
+        case ENCODING_GZIP:
+            if (deflateInit2(&s->zstream, CompressLevel > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : CompressLevel,
+                             Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                return -1;
+            }
+            return 0;
+        case ENCODING_BROTLI:
+            s->brotli = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+            if (!s->brotli) {
+                return -1;
+            }
+            BrotliEncoderSetParameter(s->brotli, BROTLI_PARAM_QUALITY,
+                                      CompressLevel > BROTLI_MAX_QUALITY ? BROTLI_MAX_QUALITY : CompressLevel);
+            BrotliEncoderSetParameter(s->brotli, BROTLI_PARAM_LGWIN, BROTLI_WINDOW_BITS);
+            BrotliEncoderSetParameter(s->brotli, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+            BrotliEncoderSetParameter(s->brotli, BROTLI_PARAM_SIZE_HINT, length > UINT32_MAX ? UINT32_MAX : length);
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Compress bytes into output buffer.
+ *
+ * @param   s           CompressStream structure.
+ * @param   data        Bytes to compress (at most COMPRESS_CHUNK).
+ * @param   length      Number of bytes in data.
+ * @param   finish      Whether these are the last bytes of the stream.
+ * @param   output      Buffer compressed bytes are appended to.
+ * @return  -1 on error and 0 on success.
+ *
+ * Encoders only emit what they have to, so most calls append nothing until
+ * the stream is finished.
+ **/
+static int compress_stream_write(CompressStream *s, const void *data, size_t length, bool finish, Buffer *output) {
+    if (s->encoding == ENCODING_GZIP) {
+        s->zstream.next_in  = (Bytef *)data;
+        s->zstream.avail_in = length;
+
+        while (true) {
+            char *space = buffer_reserve(output, COMPRESS_CHUNK);
+            if (!space) {
+                return -1;
+            }
+
+            s->zstream.next_out  = (Bytef *)space;
+            s->zstream.avail_out = COMPRESS_CHUNK;
+            int status = deflate(&s->zstream, finish ? Z_FINISH : Z_NO_FLUSH);
+            if (status == Z_STREAM_ERROR) {
+                return -1;
+            }
+            buffer_commit(output, COMPRESS_CHUNK - s->zstream.avail_out);
+
+            if (finish ? status == Z_STREAM_END : s->zstream.avail_out > 0) {
+                return 0;
+            }
+        }
+    }
+
+    const uint8_t *next_in  = data;
+    size_t         avail_in = length;
+    while (true) {
+        char *space = buffer_reserve(output, COMPRESS_CHUNK);
+        if (!space) {
+            return -1;
+        }
+
+        uint8_t *next_out  = (uint8_t *)space;
+        size_t   avail_out = COMPRESS_CHUNK;
+        if (!BrotliEncoderCompressStream(s->brotli, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+                                         &avail_in, &next_in, &avail_out, &next_out, NULL)) {
+            return -1;
+        }
+        buffer_commit(output, COMPRESS_CHUNK - avail_out);
+
+        if (finish ? BrotliEncoderIsFinished(s->brotli) : avail_in == 0 && !BrotliEncoderHasMoreOutput(s->brotli)) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Release compression stream.
+ *
+ * @param   s           CompressStream structure.
+ **/
+static void compress_stream_free(CompressStream *s) {
+    if (s->encoding == ENCODING_GZIP) {
+        deflateEnd(&s->zstream);
+    }
+    if (s->brotli) {
+        BrotliEncoderDestroyInstance(s->brotli);
+    }
+}
+
+/**
+ * Compress bytes in memory or in a file.
+ *
+ * @param   encoding    Encoding to produce (in COMPRESS_ENCODINGS).
+ * @param   data        Bytes to compress (or NULL to read them from fd).
+ * @param   fd          File to compress (if data is NULL).
+ * @param   length      Number of bytes to compress.
+ * @param   clength     Number of compressed bytes (set).
+ * @return  Compressed bytes, allocated with malloc (or NULL on error).
+ *
+ * A file is streamed through the encoder COMPRESS_CHUNK bytes at a time with
+ * pread, so its offset is left alone for requests sending it.
+ **/
+static char * compress_stream(Encoding encoding, const char *data, int fd, size_t length, size_t *clength) {
+    CompressStream s;
+    Buffer         output = {0};
+    char          *chunk  = data ? NULL : malloc(COMPRESS_CHUNK);
+
+    if ((!data && !chunk) || compress_stream_init(&s, encoding, length) < 0) {
+        free(chunk);
+        return NULL;
+    }
+
+    for (size_t offset = 0; ; ) {
+        size_t size = length - offset < COMPRESS_CHUNK ? length - offset : COMPRESS_CHUNK;
+        if (data) {
+            chunk = (char *)data + offset;
+        } else {
+            ssize_t nread = pread(fd, chunk, size, offset);
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nread < 0 || (nread == 0 && size > 0)) {
+                debug("pread failed: %s", nread < 0 ? strerror(errno) : "file truncated");
+                goto failure;
+            }
+            size = nread;
+        }
+
+        offset += size;
+        if (compress_stream_write(&s, chunk, size, offset == length, &output) < 0) {
+            goto failure;
+        }
+        if (offset == length) {
+            break;
+        }
+    }
+
+    compress_stream_free(&s);
+    if (!data) {
+        free(chunk);
+    }
+
+    /* Give back what the buffer grew by past the compressed bytes */
+    char *compressed = realloc(output.data, output.length ? output.length : 1);
+    *clength = output.length;
+    return compressed ? compressed : output.data;
+
+failure:
+    compress_stream_free(&s);
+    if (!data) {
+        free(chunk);
+    }
+    buffer_free(&output);
+    return NULL;
+}
+
+/**
+ * Compress files handed to workers until the process exits.
+ *
+ * @param   arg         Unused.
+ * @return  Never returns.
+ **/
+static void * compress_worker(void *arg) {
+    while (true) {
+        CompressJob *job = queue_pop(&Compressors.queue);
+
+        size_t length = 0;
+        char  *data   = compress_entry(job->entry, job->encoding, &length);
+        if (!file_cache_store(job->entry, job->encoding, data, length)) {
+            free(data);
+        }
+        debug("Compressed %s to %zu bytes", job->entry->uri, length);
+
+        file_cache_release(job->entry);
+        free(job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start compression workers of this process (unless they are running).
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * Workers are started on first use, so each forked worker process starts
+ * its own.
+ **/
+static int compress_start(void) {
+    int status = 0;
+
+    pthread_mutex_lock(&Compressors.lock);
+    if (Compressors.pid != getpid()) {
+        status = queue_init(&Compressors.queue, COMPRESS_QUEUE_SIZE);
+        for (size_t i = 0; status == 0 && i < COMPRESS_WORKERS; i++) {
+            pthread_t thread;
+            int error = pthread_create(&thread, NULL, compress_worker, NULL);
+            if (error) {
+                log("pthread_create failed: %s", strerror(error));
+                status = i ? 0 : -1;
+                break;
+            }
+            pthread_detach(thread);
+        }
+        if (status == 0) {
+            Compressors.pid = getpid();
+        }
+    }
+    pthread_mutex_unlock(&Compressors.lock);
+    return status;
+}
+
+/* Compression Functions */
+
+/**
+ * Return whether content is worth compressing on the fly.
+ *
+ * @param   mimetype    Content-Type of content.
+ * @param   length      Number of bytes in content.
+ *
+ * Text, scripts, and markup shrink well; images, archives, and media are
+ * compressed already.
+ **/
+bool compress_eligible(const char *mimetype, size_t length) {
+    if (CompressLevel <= 0 || length < CompressMinSize || length > COMPRESS_FILE_MAX) {
+        return false;
+    }
+
+    size_t mimelen = strlen(mimetype);
+    for (const char **prefix = CompressiblePrefixes; *prefix; prefix++) {
+        if (strncmp(mimetype, *prefix, strlen(*prefix)) == 0) {
+            return true;
+        }
+    }
+    for (const char **suffix = CompressibleSuffixes; *suffix; suffix++) {
+        size_t suflen = strlen(*suffix);
+        if (mimelen >= suflen && streq(mimetype + mimelen - suflen, *suffix)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Compress bytes in memory.
+ *
+ * @param   encoding    Encoding to produce (in COMPRESS_ENCODINGS).
+ * @param   data        Bytes to compress.
+ * @param   length      Number of bytes in data.
+ * @param   clength     Number of compressed bytes (set).
+ * @return  Compressed bytes, allocated with malloc (or NULL on error).
+ **/
+char * compress_data(Encoding encoding, const void *data, size_t length, size_t *clength) {
+    return compress_stream(encoding, data, -1, length, clength);
+}
+
+/**
+ * Compress file of file cache entry.
+ *
+ * @param   entry       FileEntry structure (HANDLER_FILE, or HANDLER_BROWSE
+ * with content, referenced).
+ * @param   encoding    Encoding to produce (in COMPRESS_ENCODINGS).
+ * @param   clength     Number of compressed bytes (set).
+ * @return  Compressed bytes, allocated with malloc (or NULL on error).
+ *
+ * The file is compressed from the content the entry holds (ie. a listing),
+ * or else read from its open file.
+ **/
+char * compress_entry(FileEntry *entry, Encoding encoding, size_t *clength) {
+    return compress_stream(encoding, entry->content, entry->fd,
+                           entry->content ? entry->content_length : entry->st.st_size, clength);
+}
+
+/**
+ * Compress file of file cache entry in the background.
+ *
+ * @param   entry       FileEntry structure (HANDLER_FILE, or HANDLER_BROWSE
+ * with content, referenced).
+ * @param   encoding    Encoding to produce (in COMPRESS_ENCODINGS).
+ *
+ * A worker compresses the file and stores it as a variant of the entry, for
+ * the requests after it; the request queueing it is sent the file as is.
+ * Nothing is queued if the variant exists, is already being compressed, or
+ * could not be kept by the file cache.  If the queue is full, the file is
+ * left for a later request to queue again.
+ **/
+void compress_queue(FileEntry *entry, Encoding encoding) {
+    if (!file_cache_claim(entry, encoding)) {
+        return;
+    }
+
+    CompressJob *job = malloc(sizeof(CompressJob));
+    if (!job || compress_start() < 0) {
+        goto failure;
+    }
+
+    job->entry    = entry;
+    job->encoding = encoding;
+    file_cache_retain(entry);
+    if (!queue_try_push(&Compressors.queue, job)) {
+        debug("Compression queue full");
+        file_cache_release(entry);
+        goto failure;
+    }
+    return;
+
+failure:
+    free(job);
+    file_cache_store(entry, encoding, NULL, 0);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,135 @@
+/* connection.c: Buffered Client Connection Functions */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#include <unistd.h>
+
+/* Connection Functions */
+
+/**
+ * Take connection from pool for accepted client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   addr        Client socket address.
+ * @param   addrlen     Length of client socket address.
+ * @return  Connection structure from ConnectionPool (or NULL on error).
+ *
+ * The client address is looked up numerically, since a DNS query would block
+ * the event loop.  On error (including either pool being exhausted), the
+ * client socket is closed.
+ *
+ * The returned connection must be deallocated using connection_free.
+ **/
+Connection * connection_create(int fd, struct sockaddr *addr, socklen_t addrlen) {
+    Connection *c = pool_get(&ConnectionPool);
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+
+    Request *r = create_request(fd, addr, addrlen);
+    if (!r) {
+        pool_put(&ConnectionPool, c);
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(Connection));
+    r->connection = c;
+    c->request = r;
+    c->state   = CONNECTION_READING;
+    c->body.fd = -1;
+    c->timer.data = c;
+
+    log("Accepted request from %s:%s", r->host, r->port);
+    return c;
+}
+
+/**
+ * Return connection and its request to their pools.
+ *
+ * @param   c           Connection structure.
+ *
+ * This closes the client socket.
+ **/
+void connection_free(Connection *c) {
+    if (!c) {
+        return;
+    }
+
+    close_body(&c->body);
+
+    free_request(c->request);
+    pool_put(&ConnectionPool, c);
+}
+
+/**
+ * Determine whether connection has buffered enough to handle its request.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether the request can be handled without further reads.
+ *
+ * This resumes the request parser over the newly received bytes.  A request
+ * is ready once it is parsed or found malformed.  A request cut short by the
+ * client or too large for the input buffer is ready as a malformed one.
+ **/
+bool connection_ready(Connection *c) {
+    Request *r = c->request;
+
+    if (parser_execute(r) != 0) {
+        return true;
+    }
+
+    if (c->eof || r->input.length == r->input.limit) {
+        r->parser.state = PARSER_ERROR;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Advance persistent connection to its next request.
+ *
+ * @param   c           Connection structure.
+ * @return  Whether the connection persists after the current request.
+ *
+ * Any bytes received after the current request are kept at the front of the
+ * input buffer, since the client may have pipelined its next request.  The
+ * output buffer is left alone, so responses to pipelined requests accumulate
+ * and are sent together.
+ **/
+bool connection_next(Connection *c) {
+    c->persist = c->request->keepalive;
+    if (!c->persist) {
+        return false;
+    }
+
+    reset_request(c->request);
+    return true;
+}
+
+/**
+ * Handle buffered requests and buffer their responses.
+ *
+ * @param   c           Connection structure.
+ *
+ * Every complete request pipelined behind the first is handled as well, so
+ * their responses can be sent in one batch.  A batch ends with the first
+ * response that has a file body, which is moved to the connection to be sent
+ * after the output buffer.  Afterwards, persist tells whether the connection
+ * should read another request once the batch is sent.
+ **/
+void connection_handle(Connection *c) {
+    Request *r = c->request;
+
+    do {
+        handle_request(r);
+
+        c->body  = r->body;
+        r->body  = (Body){.fd = -1};
+    } while (connection_next(c) && c->body.fd < 0 && r->input.length > 0 && connection_ready(c));
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,148 @@
+/* encoding.c: Content Encoding Negotiation */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+/* Constants */
+
+#define QUALITY_MAX     1000            /* Quality values in thousandths */
+
+typedef struct {
+    const char *name;                   /*< Content-coding token */
+    const char *suffix;                 /*< Extension of sidecar file */
+} EncodingInfo;
+
+/* Compressed encodings (indexed by Encoding, in order of preference) */
+static const EncodingInfo Encodings[ENCODINGS] = {
+    {"br",      ".br"},
+    {"zstd",    ".zst"},
+    {"gzip",    ".gz"},
+};
+
+/* Internal Functions */
+
+/**
+ * Parse quality value of Accept-Encoding member.
+ *
+ * @param   s           Parameters after content-coding token.
+ * @param   end         End of member.
+ * @return  Quality in thousandths (QUALITY_MAX if not given).
+ **/
+static int encoding_quality(const char *s, const char *end) {
+    while (s < end) {
+        s += strspn(s, " \t;");
+        if (s + 2 <= end && tolower(s[0]) == 'q' && s[1] == '=') {
+            s += 2;
+            int quality = 0;
+            int scale   = QUALITY_MAX;
+            if (s < end && isdigit(*s)) {
+                quality = (*s++ - '0') * QUALITY_MAX;
+            }
+            if (s < end && *s == '.') {
+                for (s++; s < end && isdigit(*s) && scale > 1; s++) {
+                    scale   /= 10;
+                    quality += (*s - '0') * scale;
+                }
+            }
+            return quality > QUALITY_MAX ? QUALITY_MAX : quality;
+        }
+        s += strcspn(s, ";");
+    }
+
+    return QUALITY_MAX;
+}
+
+/* Encoding Functions */
+
+/**
+ * Choose best encoding that client accepts and that is available.
+ *
+ * @param   accept      Value of Accept-Encoding header (or NULL).
+ * @param   available   Available compressed encodings (bit per Encoding).
+ * @return  Chosen encoding (ENCODING_IDENTITY if none is acceptable).
+ *
+ * The encoding with the highest quality value wins, and ties go to the
+ * earlier (smaller) encoding.  A "*" member covers every encoding not named
+ * on its own, and a quality of 0 refuses an encoding.  Identity only beats a
+ * compressed encoding if the client names it with a higher quality, and it
+ * is chosen even if refused, since a 406 would help nobody.
+ **/
+Encoding encoding_negotiate(const char *accept, unsigned available) {
+    int qualities[ENCODINGS];
+    int wildcard = -1;
+    int identity = 1;
+
+    if (!accept || !available) {
+        return ENCODING_IDENTITY;
+    }
+
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        qualities[e] = -1;
+    }
+
+    for (const char *s = accept; *s; ) {
+        s += strspn(s, " \t,");
+        const char *end    = s + strcspn(s, ",");
+        size_t      length = strcspn(s, " \t;,");
+
+        int quality = encoding_quality(s + length, end);
+        if (length == 1 && *s == '*') {
+            wildcard = quality;
+        }
+        for (Encoding e = 0; e < ENCODINGS; e++) {
+            if (strlen(Encodings[e].name) == length && strncasecmp(s, Encodings[e].name, length) == 0) {
+                qualities[e] = quality;
+            }
+        }
+        if (length == 6 && strncasecmp(s, "x-gzip", length) == 0) {
+            qualities[ENCODING_GZIP] = quality;
+        }
+        if (length == 8 && strncasecmp(s, "identity", length) == 0) {
+            identity = quality;
+        }
+
+        s = end;
+    }
+
+    Encoding best    = ENCODING_IDENTITY;
+    int      quality = identity > 0 ? identity - 1 : 0;
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        int q = qualities[e] >= 0 ? qualities[e] : wildcard;
+        if ((available & (1 << e)) && q > quality) {
+            best    = e;
+            quality = q;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Return extension of sidecar file holding encoding of a file.
+ *
+ * @param   encoding    Compressed encoding.
+ **/
+const char * encoding_suffix(Encoding encoding) {
+    return Encodings[encoding].suffix;
+}
+
+/**
+ * Return whether path names a sidecar file (ie. foo.js.br).
+ *
+ * @param   path        Path of file.
+ **/
+bool encoding_sidecar(const char *path) {
+    size_t length = strlen(path);
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        size_t suffix = strlen(Encodings[e].suffix);
+        if (length > suffix && streq(path + length - suffix, Encodings[e].suffix)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
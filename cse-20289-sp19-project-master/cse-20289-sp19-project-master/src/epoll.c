@@ -0,0 +1,636 @@
+/* epoll.c: Event-Driven HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define EPOLL_MAX_EVENTS    64
+
+/* Event Loop */
+
+typedef struct event_loop EventLoop;
+struct event_loop {
+    int             efd;                /*< Epoll file descriptor */
+    int             sfd;                /*< Server socket file descriptor */
+    int             wfd;                /*< Eventfd signaled when work is handed over */
+    int             cpu;                /*< CPU loop is pinned to (or -1) */
+    pthread_t       thread;             /*< Thread running loop */
+
+    pthread_mutex_t lock;               /*< Protects work and done lists */
+    Connection     *work_head;          /*< Requests and file continuations waiting */
+    Connection     *work_tail;          /*< Last connection waiting */
+    size_t          work_size;          /*< Number of connections waiting */
+    Connection     *done;               /*< Connections worked on by other loops */
+
+    TimerWheel      timers;             /*< Request, idle, and send timeouts of connections */
+    FileCache      *cache;              /*< File cache of loop (or NULL to share the default) */
+
+    EventLoop      *loops;              /*< All loops of server (for stealing) */
+    size_t          nloops;             /*< Number of loops of server */
+    size_t          victim;             /*< Next loop to wake for stealing */
+};
+
+/* Connection I/O Functions */
+
+/**
+ * Read available bytes from client into request input buffer.
+ *
+ * @param   c           Connection structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Since the socket is edge-triggered, this reads until the kernel has no more
+ * data (or the input buffer is full).
+ **/
+static int connection_read(Connection *c) {
+    Request *r = c->request;
+
+    while (r->input.length < r->input.limit) {
+        ssize_t nread = buffer_fill(&r->input, r->fd);
+        if (nread < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            debug("recv failed: %s", strerror(errno));
+            return -1;
+        }
+
+        if (nread == 0) {
+            c->eof = true;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Send as much of buffered response and file body to client as socket allows.
+ *
+ * @param   c           Connection structure.
+ * @return  -1 on error, 0 if more remains to be sent, 1 if response is sent.
+ *
+ * Buffered headers are sent with MSG_MORE ahead of a file body, so they
+ * share its first packet.  Bytes sent are counted towards SEND_RATE_MIN.
+ **/
+static int connection_write(Connection *c) {
+    Buffer *output    = &c->request->output;
+    size_t  remaining = output->length - output->offset + c->body.length;
+
+    int status = buffer_flush(output, c->request->fd, response_more(&c->body));
+    if (status > 0 && c->body.fd >= 0) {
+        status = send_body(c->request->fd, &c->body);
+    }
+
+    c->sent += remaining - (output->length - output->offset + c->body.length);
+    return status;
+}
+
+/* Event Loop Functions */
+
+/**
+ * Arm connection timer of event loop.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection structure.
+ * @param   timeout     Seconds until connection times out.
+ *
+ * This replaces any timer the connection already has.
+ **/
+static void event_loop_arm(EventLoop *loop, Connection *c, time_t timeout) {
+    timer_add(&loop->timers, &c->timer, timer_now(), timeout * 1000);
+}
+
+/**
+ * Arm timer of connection waiting for (the rest of) a request.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection structure.
+ *
+ * A connection without any request bytes waits KEEPALIVE_TIMEOUT for one to
+ * start, and then has REQUEST_TIMEOUT to send the rest of it, so a client
+ * trickling bytes cannot hold the connection forever.
+ **/
+static void event_loop_idle(EventLoop *loop, Connection *c) {
+    event_loop_arm(loop, c, c->request->input.length ? REQUEST_TIMEOUT : KEEPALIVE_TIMEOUT);
+}
+
+/**
+ * Close connection, cancelling its timer.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection structure.
+ **/
+static void event_loop_close(EventLoop *loop, Connection *c) {
+    timer_cancel(&loop->timers, &c->timer);
+    connection_free(c);
+}
+
+/**
+ * Handle expired connection timer.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection structure.
+ *
+ * A connection sending its response is only closed if it sent fewer than
+ * SEND_RATE_MIN bytes per second since its timer was armed; otherwise it gets
+ * another SEND_TIMEOUT.  Any other connection has waited too long for its
+ * request.
+ **/
+static void event_loop_timeout(EventLoop *loop, Connection *c) {
+    if (c->state == CONNECTION_WRITING && c->sent >= SEND_RATE_MIN * SEND_TIMEOUT) {
+        c->sent = 0;
+        event_loop_arm(loop, c, SEND_TIMEOUT);
+        return;
+    }
+
+    debug("Closing %s connection from %s:%s", c->state == CONNECTION_WRITING ? "slow" : "idle", c->request->host, c->request->port);
+    event_loop_close(loop, c);
+}
+
+/**
+ * Close connections whose timers expired.
+ *
+ * @param   loop        EventLoop structure.
+ * @return  Milliseconds until wheel must next be advanced (or -1 if no timer is pending).
+ **/
+static int event_loop_expire(EventLoop *loop) {
+    uint64_t now = timer_now();
+    Timer   *t   = timer_wheel_expire(&loop->timers, now);
+
+    while (t) {
+        Timer *next = t->next;
+        event_loop_timeout(loop, t->data);
+        t = next;
+    }
+
+    return timer_wheel_timeout(&loop->timers, now);
+}
+
+/**
+ * Wake event loop from epoll_wait.
+ *
+ * @param   loop        EventLoop structure.
+ **/
+static void event_loop_wake(EventLoop *loop) {
+    uint64_t one = 1;
+    if (write(loop->wfd, &one, sizeof(one)) < 0) {
+        debug("write failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * Append connection to event loop work list.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection ready to be handled or to send more.
+ * @param   state       CONNECTION_HANDLING or CONNECTION_CONTINUING.
+ *
+ * The connection's timer is cancelled, since another loop may steal it.  A
+ * continuation keeps its expiry, to be resumed once it is back.
+ **/
+static void event_loop_push(EventLoop *loop, Connection *c, ConnectionState state) {
+    timer_cancel(&loop->timers, &c->timer);
+    c->state = state;
+    c->next  = NULL;
+
+    pthread_mutex_lock(&loop->lock);
+    if (loop->work_tail) {
+        loop->work_tail->next = c;
+    } else {
+        loop->work_head = c;
+    }
+    loop->work_tail = c;
+    loop->work_size++;
+    pthread_mutex_unlock(&loop->lock);
+}
+
+/**
+ * Remove connection from head of event loop work list.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   remaining   Set to number of connections left in list.
+ * @return  Connection to handle (or NULL if list is empty).
+ *
+ * This is called both by the loop itself and by loops stealing its work.
+ **/
+static Connection * event_loop_pop(EventLoop *loop, size_t *remaining) {
+    pthread_mutex_lock(&loop->lock);
+    Connection *c = loop->work_head;
+    if (c) {
+        loop->work_head = c->next;
+        if (!loop->work_head) {
+            loop->work_tail = NULL;
+        }
+        loop->work_size--;
+    }
+    *remaining = loop->work_size;
+    pthread_mutex_unlock(&loop->lock);
+    return c;
+}
+
+static void connection_dispatch(EventLoop *loop, Connection *c);
+
+/**
+ * Send batch of responses of handled connection.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection structure.
+ *
+ * Once its responses are sent, a persistent connection goes back to reading
+ * (its next request may already be buffered, or its edge already consumed)
+ * and any other connection is freed.  Until then, the connection is timed to
+ * enforce SEND_RATE_MIN; a continuation resumes the timer it had.
+ **/
+static void event_loop_flush(EventLoop *loop, Connection *c) {
+    if (c->state == CONNECTION_CONTINUING) {
+        c->state = CONNECTION_WRITING;
+        timer_resume(&loop->timers, &c->timer);
+    } else if (c->state != CONNECTION_WRITING) {
+        c->state = CONNECTION_WRITING;
+        c->sent  = 0;
+        event_loop_arm(loop, c, SEND_TIMEOUT);
+    }
+
+    switch (connection_write(c)) {
+        case 0:
+            break;
+
+        case 1:
+            if (c->persist) {
+                c->state = CONNECTION_READING;
+                event_loop_idle(loop, c);
+                connection_dispatch(loop, c);
+                break;
+            }
+            /* fallthrough */
+
+        default:
+            event_loop_close(loop, c);
+            break;
+    }
+}
+
+/**
+ * Resume connections whose requests were handled by other loops.
+ *
+ * @param   loop        EventLoop structure.
+ *
+ * Only the owning loop touches a connection's socket or state, so a thief
+ * hands the connection back here to send its response.
+ **/
+static void event_loop_resume(EventLoop *loop) {
+    pthread_mutex_lock(&loop->lock);
+    Connection *c = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (c) {
+        Connection *next = c->next;
+        event_loop_flush(loop, c);
+        c = next;
+    }
+}
+
+/**
+ * Handle requests and send file continuations from own work list, then steal
+ * from other loops.
+ *
+ * @param   loop        EventLoop structure.
+ *
+ * While this loop is busy in a slow handler (ie. a CGI script), a sibling is
+ * woken to steal the requests and continuations still waiting behind it.
+ * Stolen requests are handled here, and stolen continuations sent as far as
+ * the socket allows, before being handed back to their owner, which finishes
+ * the write (so the connection's timer and state stay with the owner).
+ **/
+static void event_loop_work(EventLoop *loop) {
+    Connection *c;
+    size_t remaining;
+
+    while ((c = event_loop_pop(loop, &remaining))) {
+        if (c->state == CONNECTION_CONTINUING) {
+            event_loop_flush(loop, c);
+            continue;
+        }
+
+        if (remaining > 0 && loop->nloops > 1) {
+            loop->victim = (loop->victim + 1) % loop->nloops;
+            if (&loop->loops[loop->victim] == loop) {
+                loop->victim = (loop->victim + 1) % loop->nloops;
+            }
+            event_loop_wake(&loop->loops[loop->victim]);
+        }
+
+        connection_handle(c);
+        event_loop_flush(loop, c);
+    }
+
+    for (size_t i = 0; i < loop->nloops; i++) {
+        EventLoop *other = &loop->loops[i];
+        if (other == loop) {
+            continue;
+        }
+
+        while ((c = event_loop_pop(other, &remaining))) {
+            if (c->state == CONNECTION_CONTINUING) {
+                debug("Stole file continuation to %s:%s", c->request->host, c->request->port);
+                connection_write(c);
+            } else {
+                debug("Stole request from %s:%s", c->request->host, c->request->port);
+                connection_handle(c);
+            }
+
+            pthread_mutex_lock(&other->lock);
+            c->next     = other->done;
+            other->done = c;
+            pthread_mutex_unlock(&other->lock);
+            event_loop_wake(other);
+        }
+    }
+}
+
+/**
+ * Advance connection state machine after socket readiness event.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   c           Connection structure.
+ *
+ * Once its request is buffered, a connection is queued for handling and
+ * socket events are ignored until the response is ready to be sent.  When a
+ * sibling could steal it, sending more of a file body is queued as well.  The
+ * connection is closed once its response has been sent (unless it persists),
+ * when its client closes, or on error.
+ **/
+static void connection_dispatch(EventLoop *loop, Connection *c) {
+    bool waiting;
+
+    switch (c->state) {
+        case CONNECTION_READING:
+            waiting = c->request->input.length == 0;
+            if (connection_read(c) < 0) {
+                event_loop_close(loop, c);
+            } else if (connection_ready(c)) {
+                if (c->request->input.length == 0) {
+                    event_loop_close(loop, c);
+                } else {
+                    event_loop_push(loop, c, CONNECTION_HANDLING);
+                }
+            } else if (waiting && c->request->input.length > 0) {
+                event_loop_idle(loop, c);
+            }
+            break;
+
+        case CONNECTION_HANDLING:
+        case CONNECTION_CONTINUING:
+            break;
+
+        case CONNECTION_WRITING:
+            if (c->body.fd >= 0 && loop->nloops > 1) {
+                event_loop_push(loop, c, CONNECTION_CONTINUING);
+            } else {
+                event_loop_flush(loop, c);
+            }
+            break;
+    }
+}
+
+/**
+ * Accept all pending clients and register them with event loop.
+ *
+ * @param   loop        EventLoop structure.
+ **/
+static void accept_connections(EventLoop *loop) {
+    while (true) {
+        struct sockaddr_storage raddr;
+        socklen_t rlen = sizeof(raddr);
+
+        int client_fd = accept4(loop->sfd, (struct sockaddr *)&raddr, &rlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        Connection *c = connection_create(client_fd, (struct sockaddr *)&raddr, rlen);
+        if (!c) {
+            continue;
+        }
+        c->owner = loop;
+        event_loop_arm(loop, c, REQUEST_TIMEOUT);
+
+        struct epoll_event event = {
+            .events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(loop->efd, EPOLL_CTL_ADD, client_fd, &event) < 0) {
+            fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+            event_loop_close(loop, c);
+        }
+    }
+}
+
+/**
+ * Initialize event loop for server socket.
+ *
+ * @param   loop        EventLoop structure.
+ * @param   sfd         Server socket file descriptor.
+ * @param   loops       All loops of server.
+ * @param   nloops      Number of loops of server.
+ * @return  -1 on error and 0 on success.
+ *
+ * The server socket is registered with NULL data and the eventfd with the
+ * loop itself, so they can be told apart from client connections.
+ **/
+static int event_loop_init(EventLoop *loop, int sfd, EventLoop *loops, size_t nloops) {
+    memset(loop, 0, sizeof(EventLoop));
+    loop->sfd    = sfd;
+    loop->cpu    = -1;
+    loop->loops  = loops;
+    loop->nloops = nloops;
+    loop->victim = loop - loops;
+    pthread_mutex_init(&loop->lock, NULL);
+    timer_wheel_init(&loop->timers, timer_now());
+
+    /* Create epoll instance and wakeup eventfd */
+    loop->efd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->efd < 0 || loop->wfd < 0) {
+        fprintf(stderr, "Unable to create event loop: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Register non-blocking server socket and eventfd */
+    if (fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct epoll_event events[] = {
+        {.events = EPOLLIN | EPOLLET, .data.ptr = NULL},
+        {.events = EPOLLIN | EPOLLET, .data.ptr = loop},
+    };
+    if (epoll_ctl(loop->efd, EPOLL_CTL_ADD, sfd, &events[0]) < 0 ||
+        epoll_ctl(loop->efd, EPOLL_CTL_ADD, loop->wfd, &events[1]) < 0) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Run event loop until epoll_wait fails.
+ *
+ * @param   arg         EventLoop structure.
+ * @return  NULL.
+ **/
+static void * event_loop_run(void *arg) {
+    EventLoop *loop = arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    /* Load files (for own and stolen requests) into the loop's own cache */
+    file_cache_use(loop->cache);
+
+    /* Pin loop to its CPU */
+    if (loop->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            fprintf(stderr, "sched_setaffinity failed: %s\n", strerror(errno));
+        }
+    }
+
+    /* Wait for and dispatch socket events until next timeout */
+    while (true) {
+        int n = epoll_wait(loop->efd, events, EPOLL_MAX_EVENTS, event_loop_expire(loop));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop);
+            } else if (events[i].data.ptr == loop) {
+                uint64_t count;
+                while (read(loop->wfd, &count, sizeof(count)) > 0);
+            } else {
+                connection_dispatch(loop, events[i].data.ptr);
+            }
+        }
+
+        event_loop_resume(loop);
+        event_loop_work(loop);
+    }
+
+    return NULL;
+}
+
+/**
+ * Multiplex HTTP requests with an edge-triggered epoll event loop.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_FAILURE once the loop fails).
+ *
+ * Each client socket is non-blocking and owns a Connection that moves from
+ * reading its request, to handling it, to writing the response, as the
+ * socket becomes ready.  Persistent connections then return to reading, and
+ * are closed after KEEPALIVE_TIMEOUT seconds without a request.  A timer
+ * wheel also closes clients too slow to send their request within
+ * REQUEST_TIMEOUT or to accept their response at SEND_RATE_MIN.  CGI scripts
+ * still run synchronously within the loop, with their output buffered up to
+ * a limit (see handle_cgi_request).
+ **/
+int epoll_server(int sfd) {
+    EventLoop loop;
+
+    if (event_loop_init(&loop, sfd, &loop, 1) == 0) {
+        event_loop_run(&loop);
+    }
+
+    close(loop.efd);
+    close(loop.wfd);
+    close(sfd);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Run one event loop per CPU, each with its own listening socket.
+ *
+ * @param   port        Port number for loops to listen on.
+ * @return  Exit status of server (EXIT_FAILURE once a loop fails).
+ *
+ * Every loop binds its socket with SO_REUSEPORT, so the kernel spreads
+ * connections across loops, and each loop's thread is pinned to its own CPU.
+ * Each loop also has its own file cache, with an equal share of
+ * ContentCacheBytes, so loops never contend for one cache lock.  A loop that
+ * is idle steals requests and large-file continuations queued behind a busy
+ * loop's handler.
+ **/
+int sharded_server(const char *port) {
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+        fprintf(stderr, "sched_getaffinity failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    size_t nloops = Workers ? Workers : CPU_COUNT(&cpus);
+    EventLoop *loops = calloc(nloops, sizeof(EventLoop));
+    if (!loops) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Create loops, assigning allowed CPUs round-robin */
+    int cpu = -1;
+    for (size_t i = 0; i < nloops; i++) {
+        do {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(cpu, &cpus));
+
+        int sfd = socket_listen(port, true);
+        if (sfd < 0) {
+            fatal("socket_listen failure %s", strerror(errno));
+        }
+
+        if (event_loop_init(&loops[i], sfd, loops, nloops) < 0) {
+            fatal("Unable to initialize event loop %zu", i);
+        }
+        loops[i].cpu   = cpu;
+        loops[i].cache = file_cache_create(nloops);
+    }
+
+    /* Run every loop on its own thread */
+    for (size_t i = 0; i < nloops; i++) {
+        int error = pthread_create(&loops[i].thread, NULL, event_loop_run, &loops[i]);
+        if (error) {
+            fatal("pthread_create failed: %s", strerror(error));
+        }
+    }
+    log("Started %zu event loops", nloops);
+
+    pthread_join(loops[0].thread, NULL);
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
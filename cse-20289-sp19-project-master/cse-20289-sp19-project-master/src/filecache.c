@@ -0,0 +1,748 @@
+/* filecache.c: Open File, Metadata, and Content Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+/* File Cache */
+
+struct file_cache {
+    FileEntry      **buckets;           /*< Hash chains (power of two) */
+    size_t           nbuckets;          /*< Number of buckets */
+    size_t           count;             /*< Number of cached entries */
+    size_t           bytes;             /*< Number of content and variant bytes held by cached entries */
+    uint64_t         generation;        /*< Number of invalidations so far */
+    FileEntry       *lru_head;          /*< Most recently used entry */
+    FileEntry       *lru_tail;          /*< Least recently used entry */
+    pthread_mutex_t  lock;              /*< Protects cache and reference counts */
+    size_t           shares;            /*< Number of caches splitting ContentCacheBytes */
+    FileCache       *next;              /*< Next cache (in Caches list) */
+};
+
+/* Cache shared by every thread that uses no cache of its own */
+static FileCache Cache = {
+    .lock   = PTHREAD_MUTEX_INITIALIZER,
+    .shares = 1,
+};
+
+/* Every cache, so changes reach them all */
+static FileCache      *Caches     = &Cache;
+static pthread_mutex_t CachesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cache used by calling thread (or NULL for the shared one) */
+static __thread FileCache *Current;
+
+/* Internal Functions */
+
+/**
+ * Hash uri with FNV-1a.
+ *
+ * @param   uri         Requested URI.
+ * @return  Hash of uri.
+ **/
+static uint64_t file_cache_hash(const char *uri) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)uri; *c; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Return cache used by calling thread.
+ **/
+static FileCache * file_cache_current(void) {
+    return Current ? Current : &Cache;
+}
+
+/**
+ * Return most content and variant bytes cache holds.
+ *
+ * @param   cache       FileCache structure.
+ **/
+static size_t file_cache_budget(const FileCache *cache) {
+    return ContentCacheBytes / cache->shares;
+}
+
+/**
+ * Return current time of monotonic clock in seconds.
+ **/
+static time_t file_cache_now(void) {
+    return timer_now() / 1000;
+}
+
+/**
+ * Free entry, closing its file (called with lock held).
+ *
+ * @param   entry       FileEntry structure (no references left).
+ **/
+static void file_cache_free(FileEntry *entry) {
+    if (entry->fd >= 0) {
+        close(entry->fd);
+    }
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        free(entry->variants[e]);
+    }
+    free(entry->content);
+    free(entry);
+}
+
+/**
+ * Return number of content bytes entry counts against its cache's budget.
+ *
+ * @param   entry       FileEntry structure.
+ **/
+static size_t file_cache_bytes(const FileEntry *entry) {
+    size_t bytes = entry->content ? entry->content_length + entry->headers_length : 0;
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        bytes += entry->variant_lengths[e];
+    }
+    return bytes;
+}
+
+/**
+ * Return whether entry was loaded too long ago to be trusted.
+ *
+ * @param   entry       FileEntry structure.
+ *
+ * While RootPath is watched, entries are trusted until a change beneath them
+ * is posted.
+ **/
+static bool file_cache_stale(const FileEntry *entry) {
+    return !watch_active() && file_cache_now() - entry->loaded >= FileCacheValidity;
+}
+
+/**
+ * Remove entry from LRU list (called with lock held).
+ *
+ * @param   entry       FileEntry structure (cached).
+ **/
+static void file_cache_lru_unlink(FileEntry *entry) {
+    FileCache *cache = entry->cache;
+
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * Add entry to front of LRU list (called with lock held).
+ *
+ * @param   entry       FileEntry structure (cached, not in LRU list).
+ **/
+static void file_cache_lru_push(FileEntry *entry) {
+    FileCache *cache = entry->cache;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = entry;
+    } else {
+        cache->lru_tail = entry;
+    }
+    cache->lru_head = entry;
+}
+
+/**
+ * Remove entry from cache, dropping the reference the cache holds (called
+ * with lock held).
+ *
+ * @param   entry       FileEntry structure (cached).
+ *
+ * Requests still sending the file keep it open until they release it.
+ **/
+static void file_cache_remove(FileEntry *entry) {
+    FileCache  *cache = entry->cache;
+    FileEntry **link  = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    file_cache_lru_unlink(entry);
+    entry->cached = false;
+    cache->count--;
+    cache->bytes -= file_cache_bytes(entry);
+
+    if (--entry->refs == 0) {
+        file_cache_free(entry);
+    }
+}
+
+/**
+ * Look up entry for uri, marking it most recently used (called with lock
+ * held).
+ *
+ * @param   cache       FileCache structure.
+ * @param   uri         Requested URI.
+ * @param   hash        Hash of uri.
+ * @return  FileEntry structure (or NULL if uri is not cached).
+ *
+ * The entry may be stale, in which case the caller revalidates it.
+ **/
+static FileEntry * file_cache_lookup(FileCache *cache, const char *uri, uint64_t hash) {
+    if (!cache->buckets) {
+        return NULL;
+    }
+
+    for (FileEntry *entry = cache->buckets[hash & (cache->nbuckets - 1)]; entry; entry = entry->hash_next) {
+        if (entry->hash != hash || !streq(entry->uri, uri)) {
+            continue;
+        }
+
+        file_cache_lru_unlink(entry);
+        file_cache_lru_push(entry);
+        return entry;
+    }
+
+    return NULL;
+}
+
+/**
+ * Insert entry into its cache, evicting least recently used entries to stay
+ * within FileCacheEntries and the cache's budget (called with lock held).
+ *
+ * @param   entry       FileEntry structure (not cached).
+ * @return  Whether entry was inserted.
+ **/
+static bool file_cache_insert(FileEntry *entry) {
+    FileCache *cache = entry->cache;
+
+    if (!cache->buckets) {
+        size_t nbuckets = 1;
+        while (nbuckets < FileCacheEntries) {
+            nbuckets <<= 1;
+        }
+
+        cache->buckets = calloc(nbuckets, sizeof(FileEntry *));
+        if (!cache->buckets) {
+            return false;
+        }
+        cache->nbuckets = nbuckets;
+    }
+
+    size_t bytes = file_cache_bytes(entry);
+    while ((cache->count >= FileCacheEntries || cache->bytes + bytes > file_cache_budget(cache)) && cache->lru_tail) {
+        file_cache_remove(cache->lru_tail);
+    }
+
+    FileEntry **bucket = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    entry->hash_next = *bucket;
+    *bucket          = entry;
+    entry->cached    = true;
+    entry->refs++;
+    file_cache_lru_push(entry);
+    cache->count++;
+    cache->bytes += bytes;
+    return true;
+}
+
+/**
+ * Count bytes added to cached entry, evicting least recently used entries to
+ * stay within the cache's budget (called with lock held).
+ *
+ * @param   entry       FileEntry structure (cached).
+ * @param   bytes       Number of content or variant bytes added.
+ **/
+static void file_cache_grow(FileEntry *entry, size_t bytes) {
+    FileCache *cache = entry->cache;
+
+    cache->bytes += bytes;
+    while (cache->bytes > file_cache_budget(cache) && cache->lru_tail && cache->lru_tail != entry) {
+        file_cache_remove(cache->lru_tail);
+    }
+}
+
+/**
+ * Find sidecar files holding compressed encodings of file.
+ *
+ * @param   entry       FileEntry structure (HANDLER_FILE).
+ * @return  Encodings with a sidecar (bit per Encoding).
+ *
+ * A sidecar only counts if it is a regular file that is smaller than the
+ * file and no older than it, so a stale sidecar left behind by an update is
+ * never sent in its place.
+ **/
+static unsigned file_cache_sidecars(const FileEntry *entry) {
+    unsigned encodings = 0;
+
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s%s", entry->path, encoding_suffix(e)) >= (int)sizeof(path)) {
+            continue;
+        }
+
+        struct stat st;
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size >= entry->st.st_size) {
+            continue;
+        }
+        if (st.st_mtim.tv_sec < entry->st.st_mtim.tv_sec ||
+            (st.st_mtim.tv_sec == entry->st.st_mtim.tv_sec && st.st_mtim.tv_nsec < entry->st.st_mtim.tv_nsec)) {
+            continue;
+        }
+
+        encodings |= 1 << e;
+    }
+
+    return encodings;
+}
+
+/**
+ * Read small file into memory along with its rendered headers.
+ *
+ * @param   entry       FileEntry structure (HANDLER_FILE with open fd).
+ *
+ * On success, the file is closed, since requests are served from memory
+ * alone; otherwise, the entry is left to be sent from its file.
+ **/
+static void file_cache_read(FileEntry *entry) {
+    size_t      size     = entry->st.st_size;
+    const char *mimetype = determine_mimetype(entry->path);
+    Encoding    encoding = entry->encodings || entry->compressible ? ENCODING_IDENTITY : ENCODING_NONE;
+    size_t      length   = response_headers(NULL, 0, mimetype, size, encoding);
+    char       *content  = malloc(size + length + 1);
+
+    if (!content) {
+        return;
+    }
+
+    for (size_t nread = 0; nread < size; ) {
+        ssize_t result = pread(entry->fd, content + nread, size - nread, nread);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            debug("pread failed: %s", result < 0 ? strerror(errno) : "file truncated");
+            free(content);
+            return;
+        }
+        nread += result;
+    }
+
+    entry->content        = content;
+    entry->content_length = size;
+    entry->headers        = content + size;
+    entry->headers_length = response_headers(entry->headers, length + 1, mimetype, size, encoding);
+
+    close(entry->fd);
+    entry->fd = -1;
+}
+
+/**
+ * Resolve uri and open or classify the path it names.
+ *
+ * @param   cache       FileCache structure entry belongs to.
+ * @param   uri         Requested URI.
+ * @param   hash        Hash of uri.
+ * @return  FileEntry structure with one reference (or NULL if path does not
+ * exist or is outside RootPath).
+ *
+ * This does the syscalls a cache hit saves: realpath, stat, access, open, a
+ * stat for each sidecar, and for files up to ContentCacheFileMax bytes, read.
+ * A file without sidecars is compressed on the fly if its mimetype and size
+ * are eligible, unless it is a sidecar itself (which is compressed already).
+ **/
+static FileEntry * file_cache_load(FileCache *cache, const char *uri, uint64_t hash) {
+    char path[PATH_MAX];
+    if (!determine_request_path(uri, path)) {
+        return NULL;
+    }
+
+    size_t urilen  = strlen(uri) + 1;
+    size_t pathlen = strlen(path) + 1;
+    FileEntry *entry = calloc(1, sizeof(FileEntry) + urilen + pathlen);
+    if (!entry) {
+        return NULL;
+    }
+
+    memcpy(entry->uri, uri, urilen);
+    entry->path   = entry->uri + urilen;
+    memcpy(entry->path, path, pathlen);
+    entry->cache  = cache;
+    entry->hash   = hash;
+    entry->loaded = file_cache_now();
+    entry->refs   = 1;
+    entry->fd     = -1;
+
+    if (stat(entry->path, &entry->st) < 0) {
+        debug("stat failed: %s", strerror(errno));
+        free(entry);
+        return NULL;
+    }
+
+    if (S_ISDIR(entry->st.st_mode)) {
+        entry->handler = HANDLER_BROWSE;
+    } else if (access(entry->path, X_OK) == 0) {
+        entry->handler = HANDLER_CGI;
+    } else if (access(entry->path, R_OK) == 0) {
+        entry->fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+        entry->handler = entry->fd < 0 ? HANDLER_ERROR : HANDLER_FILE;
+        size_t size = entry->st.st_size;
+        if (entry->fd >= 0) {
+            entry->encodings    = file_cache_sidecars(entry);
+            entry->compressible = !entry->encodings && !encoding_sidecar(entry->path) &&
+                                  compress_eligible(determine_mimetype(entry->path), size);
+        }
+        if (entry->fd >= 0 && FileCacheEntries > 0 && size <= ContentCacheFileMax && size < file_cache_budget(cache)) {
+            file_cache_read(entry);
+        }
+    } else {
+        entry->handler = HANDLER_ERROR;
+    }
+
+    return entry;
+}
+
+/* File Cache Functions */
+
+/**
+ * Create cache for threads that are not to share the default one.
+ *
+ * @param   shares      Number of caches splitting ContentCacheBytes.
+ * @return  FileCache structure (or NULL on error).
+ *
+ * The cache lives as long as the process, and is kept in step with changes
+ * beneath RootPath along with every other cache.
+ **/
+FileCache * file_cache_create(size_t shares) {
+    FileCache *cache = calloc(1, sizeof(FileCache));
+    if (!cache) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->shares = shares ? shares : 1;
+
+    pthread_mutex_lock(&CachesLock);
+    cache->next = Caches;
+    Caches      = cache;
+    pthread_mutex_unlock(&CachesLock);
+    return cache;
+}
+
+/**
+ * Make calling thread look up and load entries in cache.
+ *
+ * @param   cache       FileCache structure (or NULL for the shared one).
+ *
+ * Entries remember their cache, so another thread may still hold, release,
+ * or store variants of them.
+ **/
+void file_cache_use(FileCache *cache) {
+    Current = cache;
+}
+
+/**
+ * Look up cached entry for uri without touching the file system.
+ *
+ * @param   uri         Requested URI.
+ * @return  FileEntry structure with a reference for the caller (or NULL if
+ * uri is not cached or its entry is stale).
+ **/
+FileEntry * file_cache_find(const char *uri) {
+    FileCache *cache = file_cache_current();
+    uint64_t   hash  = file_cache_hash(uri);
+
+    pthread_mutex_lock(&cache->lock);
+    FileEntry *entry = file_cache_lookup(cache, uri, hash);
+    if (entry && !file_cache_stale(entry)) {
+        entry->refs++;
+    } else {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/**
+ * Look up entry for uri, loading and caching it on a miss.
+ *
+ * @param   uri         Requested URI.
+ * @return  FileEntry structure with a reference for the caller (or NULL if
+ * path does not exist).
+ *
+ * Entries are trusted for FileCacheValidity seconds.  After that, a single
+ * stat checks whether the file still has the same inode, mode, size, and
+ * mtime; if so, the entry (and any content it holds) is trusted again, and
+ * otherwise it is replaced.  If the cache is disabled, or something changed
+ * while the path was loaded, the entry returned is owned by the caller alone.
+ **/
+FileEntry * file_cache_get(const char *uri) {
+    FileCache *cache = file_cache_current();
+    uint64_t   hash  = file_cache_hash(uri);
+
+    pthread_mutex_lock(&cache->lock);
+    uint64_t   generation = cache->generation;
+    FileEntry *entry      = file_cache_lookup(cache, uri, hash);
+    if (entry) {
+        entry->refs++;
+        if (!file_cache_stale(entry)) {
+            pthread_mutex_unlock(&cache->lock);
+            return entry;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    /* Revalidate stale entry against its file */
+    if (entry) {
+        struct stat st;
+        bool same = stat(entry->path, &st) == 0
+                 && st.st_dev  == entry->st.st_dev
+                 && st.st_ino  == entry->st.st_ino
+                 && st.st_mode == entry->st.st_mode
+                 && st.st_size == entry->st.st_size
+                 && st.st_mtim.tv_sec  == entry->st.st_mtim.tv_sec
+                 && st.st_mtim.tv_nsec == entry->st.st_mtim.tv_nsec;
+
+        pthread_mutex_lock(&cache->lock);
+        if (same) {
+            entry->loaded = file_cache_now();
+            pthread_mutex_unlock(&cache->lock);
+            return entry;
+        }
+        if (entry->cached) {
+            file_cache_remove(entry);
+        }
+        if (--entry->refs == 0) {
+            file_cache_free(entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+
+    entry = file_cache_load(cache, uri, hash);
+    if (!entry || FileCacheEntries == 0) {
+        return entry;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->generation != generation) {   /* Changed while loading */
+        pthread_mutex_unlock(&cache->lock);
+        return entry;
+    }
+
+    FileEntry *other = file_cache_lookup(cache, uri, hash);
+    if (other && !file_cache_stale(other)) {    /* Loaded by another thread meanwhile */
+        other->refs++;
+        pthread_mutex_unlock(&cache->lock);
+        file_cache_free(entry);
+        return other;
+    }
+    if (other) {
+        file_cache_remove(other);
+    }
+    file_cache_insert(entry);
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/**
+ * Take another reference to entry.
+ *
+ * @param   entry       FileEntry structure.
+ **/
+void file_cache_retain(FileEntry *entry) {
+    pthread_mutex_lock(&entry->cache->lock);
+    entry->refs++;
+    pthread_mutex_unlock(&entry->cache->lock);
+}
+
+/**
+ * Drop reference to entry, freeing it once it is unreferenced.
+ *
+ * @param   entry       FileEntry structure.
+ **/
+void file_cache_release(FileEntry *entry) {
+    pthread_mutex_lock(&entry->cache->lock);
+    if (--entry->refs == 0) {
+        file_cache_free(entry);
+    }
+    pthread_mutex_unlock(&entry->cache->lock);
+}
+
+/**
+ * Look up compressed variant of entry.
+ *
+ * @param   entry       FileEntry structure (referenced).
+ * @param   encoding    Compressed encoding.
+ * @param   length      Number of bytes in variant (set).
+ * @return  Compressed file bytes (or NULL if not compressed yet).
+ *
+ * A variant is never replaced, so it stays valid for as long as the caller
+ * holds its reference.  Since an entry is dropped or replaced as soon as its
+ * file changes, variants are in effect keyed by path, mtime, and encoding.
+ **/
+const char * file_cache_variant(FileEntry *entry, Encoding encoding, size_t *length) {
+    pthread_mutex_lock(&entry->cache->lock);
+    const char *data = entry->variants[encoding];
+    *length = entry->variant_lengths[encoding];
+    pthread_mutex_unlock(&entry->cache->lock);
+    return data;
+}
+
+/**
+ * Claim compressing variant of entry.
+ *
+ * @param   entry       FileEntry structure (referenced).
+ * @param   encoding    Compressed encoding.
+ * @return  Whether caller is to compress the variant and store it.
+ *
+ * Only a cached entry without the variant is claimed, and only by one caller
+ * at a time, so each file is compressed once.
+ **/
+bool file_cache_claim(FileEntry *entry, Encoding encoding) {
+    pthread_mutex_lock(&entry->cache->lock);
+    bool claimed = entry->cached && file_cache_budget(entry->cache) > 0 && !entry->variants[encoding] &&
+                   !(entry->compressing & (1 << encoding));
+    if (claimed) {
+        entry->compressing |= 1 << encoding;
+    }
+    pthread_mutex_unlock(&entry->cache->lock);
+    return claimed;
+}
+
+/**
+ * Store compressed variant of entry, evicting least recently used entries to
+ * stay within the cache's budget.
+ *
+ * @param   entry       FileEntry structure (referenced).
+ * @param   encoding    Compressed encoding.
+ * @param   data        Compressed file bytes, allocated with malloc (or NULL
+ * to drop claim).
+ * @param   length      Number of bytes in data.
+ * @return  Whether entry took ownership of data.
+ *
+ * Any claim on the variant is dropped.  The variant is not kept if the entry
+ * is no longer cached, already has one, or it would not fit its cache's budget.
+ **/
+bool file_cache_store(FileEntry *entry, Encoding encoding, char *data, size_t length) {
+    pthread_mutex_lock(&entry->cache->lock);
+    entry->compressing &= ~(1 << encoding);
+
+    bool kept = data && entry->cached && !entry->variants[encoding] && length <= file_cache_budget(entry->cache);
+    if (kept) {
+        entry->variants[encoding]        = data;
+        entry->variant_lengths[encoding] = length;
+        file_cache_grow(entry, length);
+    }
+    pthread_mutex_unlock(&entry->cache->lock);
+    return kept;
+}
+
+/**
+ * Look up content of entry.
+ *
+ * @param   entry       FileEntry structure (referenced).
+ * @return  Content (or NULL if entry holds none).
+ *
+ * This is for content stored after the entry was loaded (ie. a listing),
+ * which then stays valid for as long as the caller holds its reference.
+ **/
+const char * file_cache_content(FileEntry *entry) {
+    pthread_mutex_lock(&entry->cache->lock);
+    const char *content = entry->content;
+    pthread_mutex_unlock(&entry->cache->lock);
+    return content;
+}
+
+/**
+ * Store rendered content of entry, evicting least recently used entries to
+ * stay within the cache's budget.
+ *
+ * @param   entry       FileEntry structure (HANDLER_BROWSE, referenced).
+ * @param   content     Rendered body followed by its headers (as rendered by
+ * response_headers), allocated with malloc.
+ * @param   length      Number of bytes in body.
+ * @param   headers_length  Number of bytes in headers.
+ * @return  Whether entry took ownership of content.
+ *
+ * This keeps the listing of a directory until the directory changes, which
+ * drops its entry.  The content is not kept if the entry is no longer
+ * cached, already has content, or it would not fit the cache's budget.
+ **/
+bool file_cache_store_content(FileEntry *entry, char *content, size_t length, size_t headers_length) {
+    pthread_mutex_lock(&entry->cache->lock);
+    bool kept = entry->cached && !entry->content && length + headers_length <= file_cache_budget(entry->cache);
+    if (kept) {
+        entry->content        = content;
+        entry->content_length = length;
+        entry->headers        = content + length;
+        entry->headers_length = headers_length;
+        file_cache_grow(entry, length + headers_length);
+    }
+    pthread_mutex_unlock(&entry->cache->lock);
+    return kept;
+}
+
+/**
+ * Return whether changed path affects file named by path.
+ *
+ * @param   name        Path of file.
+ * @param   path        Changed path.
+ * @param   length      Number of bytes in path.
+ * @param   recursive   Whether everything beneath path changed as well.
+ **/
+static bool file_cache_affected(const char *name, const char *path, size_t length, bool recursive) {
+    return strncmp(name, path, length) == 0 && (name[length] == '\0' || (recursive && name[length] == '/'));
+}
+
+/**
+ * Drop every entry for changed path from every cache (subscribed to RootPath).
+ *
+ * @param   path        Changed path (absolute).
+ * @param   recursive   Whether entries beneath path are dropped as well.
+ * @param   arg         Unused.
+ *
+ * Entries are dropped by the path they resolved to, so a change to a file is
+ * seen by every URI naming it, and by the path their URI names beneath
+ * RootPath, so a symbolic link that is replaced is seen as well.  A change to
+ * a sidecar (ie. foo.js.gz) drops the entry of its file (foo.js) too.
+ **/
+void file_cache_invalidate(const char *path, bool recursive, void *arg) {
+    size_t length  = strlen(path);
+    size_t rootlen = strlen(RootPath);
+    bool   beneath = file_cache_affected(path, RootPath, rootlen, true);
+
+    /* A changed sidecar changes the encodings of the file next to it */
+    size_t base = length;
+    for (Encoding e = 0; e < ENCODINGS && !recursive; e++) {
+        size_t suffix = strlen(encoding_suffix(e));
+        if (length > suffix && streq(path + length - suffix, encoding_suffix(e))) {
+            base = length - suffix;
+        }
+    }
+
+    pthread_mutex_lock(&CachesLock);
+    for (FileCache *cache = Caches; cache; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        cache->generation++;
+
+        FileEntry *entry = cache->lru_head;
+        while (entry) {
+            FileEntry *next = entry->lru_next;
+            if (file_cache_affected(entry->path, path, length, recursive) ||
+                file_cache_affected(entry->path, path, base, recursive) ||
+                (beneath && file_cache_affected(entry->uri, path + rootlen, length - rootlen, recursive)) ||
+                (beneath && base > rootlen && file_cache_affected(entry->uri, path + rootlen, base - rootlen, recursive))) {
+                file_cache_remove(entry);
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    pthread_mutex_unlock(&CachesLock);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -18,13 +18,19 @@
  * handle the request.
  **/
 int forking_server(int sfd) {
+    /* Ignore children */
+    signal(SIGCHLD, SIG_IGN);
+
     /* Accept and handle HTTP request */
     while (true) {
     	/* Accept request */
         Request *r = accept_request(sfd);
+        if (!r) {
+            continue;
+        }
 
-	/* Ignore children */
-        signal(SIGCHLD, SIG_IGN);
+	/* Reload mime types before children copy them */
+        mimetypes_refresh();
 
 	/* Fork off child process to handle request */
         pid_t pid = fork();
@@ -32,7 +38,11 @@ int forking_server(int sfd) {
         if(pid < 0){ // Error
             fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
         } else if (pid == 0){ // Child
-            handle_request(r);
+            do {
+                handle_request(r);
+            } while (r->keepalive && next_request(r));
+            free_request(r);
+            exit(EXIT_SUCCESS);
         } else {  // Parent
              // Nothing
         }
@@ -1,20 +1,30 @@
 /* handler.c: HTTP Request Handlers */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <signal.h>
+#include <spawn.h>
 #include <string.h>
 
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+/* Constants */
+
+#define CGI_VARIABLES_MAX   (8 + HEADER_FIELDS) /* Upper bound on variables added for a CGI request */
+#define CGI_OUTPUT_MAX      (1 << 20)   /* Most CGI output buffered for an event loop connection */
+
 /* Internal Declarations */
 Status handle_browse_request(Request *request);
 Status handle_file_request(Request *request);
 Status handle_cgi_request(Request *request);
-Status handle_error(Request *request, Status status);
 
 /**
  * Handle HTTP Request.
@@ -22,8 +32,7 @@ Status handle_error(Request *request, Status status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request and then dispatches it with dispatch_request.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
@@ -34,48 +43,60 @@ Status  handle_request(Request *r) {
     int parseStat = parse_request(r);
     if(parseStat < 0){  // This means there was a bad request or header
         fprintf(stderr, "parse_request failed\n");
+        r->keepalive = false;                   // Rest of stream cannot be trusted
         result = HTTP_STATUS_BAD_REQUEST;
         handle_error(r, result);
-        r->path = strdup(" ");
         return result;
     }
 
-    /* Determine request path */
-    r->path = determine_request_path(r->uri);
-    if(r->path == NULL){
-        fprintf(stderr, "determine_request_path failed\n");
+    return dispatch_request(r);
+}
+
+/**
+ * Dispatch parsed HTTP Request.
+ *
+ * @param   r           HTTP Request structure
+ * @return  Status of the HTTP request.
+ *
+ * This looks up the request path and type in the file cache, and then
+ * dispatches to the appropriate handler type.
+ **/
+Status  dispatch_request(Request *r) {
+    Status result;
+
+    /* Determine request path and type from file cache (unless the caller
+     * already found the entry) */
+    if(r->entry == NULL){
+        r->entry = file_cache_get(r->uri);
+    }
+    if(r->entry == NULL){
+        fprintf(stderr, "file_cache_get failed\n");
         result = HTTP_STATUS_NOT_FOUND;
         handle_error(r, result);
         return result;
     }
+    r->path = r->entry->path;
 
     debug("HTTP REQUEST PATH: %s", r->path);
     /* Dispatch to appropriate request handler type based on file type */
-    
-    /* Stat items */
-    struct stat statusTemp;
-    if(stat(r->path, &statusTemp) < 0 ) {                       //stat the file to get information regarding the type
-        fprintf(stderr, "stat failure %s\n", strerror(errno));
-        result = HTTP_STATUS_NOT_FOUND;
-        handle_error(r, result);
-        return result;
-    }
-    int RWFlag = access(r->path, R_OK);                         //access also tells more information regarding the type, read and execute
-    int XFlag = access(r->path, X_OK);
-    
-    if((statusTemp.st_mode & S_IFMT) == S_IFDIR){
-        log("HTTP REQUEST TYPE: BROWSE");
-        result = handle_browse_request(r);                      //If a directory, browse
-    } else if(XFlag == 0){
-        log("HTTP REQUEST TYPE: CGI");
-        result = handle_cgi_request(r);                         //If a CGI script, handle accordingly
-    } else if (RWFlag == 0){
-        log("HTTP REQUEST TYPE: FILE");
-        result = handle_file_request(r);                        //If a file, output its contents
-    } else{
-        log("HTTP REQUEST TYPE: ERROR");
-        result = HTTP_STATUS_NOT_FOUND;                         //If none, error
-        result = handle_error(r, result);
+    switch(r->entry->handler){
+        case HANDLER_BROWSE:
+            log("HTTP REQUEST TYPE: BROWSE");
+            result = handle_browse_request(r);                  //If a directory, browse
+            break;
+        case HANDLER_CGI:
+            log("HTTP REQUEST TYPE: CGI");
+            result = handle_cgi_request(r);                     //If a CGI script, handle accordingly
+            break;
+        case HANDLER_FILE:
+            log("HTTP REQUEST TYPE: FILE");
+            result = handle_file_request(r);                    //If a file, output its contents
+            break;
+        default:
+            log("HTTP REQUEST TYPE: ERROR");
+            result = HTTP_STATUS_NOT_FOUND;                     //If none, error
+            result = handle_error(r, result);
+            break;
     }
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
 
@@ -83,49 +104,171 @@ Status  handle_request(Request *r) {
 }
  
 /**
- * Handle browse request.
+ * Negotiate compressed encoding of body and look up (or make) its variant.
  *
  * @param   r           HTTP Request structure.
- * @return  Status of the HTTP browse request.
+ * @param   entry       FileEntry structure the variant belongs to.
+ * @param   body        Body bytes (or NULL to compress from entry).
+ * @param   size        Number of bytes in body.
+ * @param   variant     Compressed body (set, unless identity is chosen).
+ * @param   length      Number of bytes in variant (set).
+ * @param   owned       Variant the caller must free once sent (set, or NULL).
+ * @return  Encoding to send (ENCODING_IDENTITY to send body as is).
+ *
+ * A missing variant of up to COMPRESS_INLINE_MAX bytes is compressed by this
+ * thread and kept by the file cache; a larger one is left to a compression
+ * worker (if the entry holds the body), while this request is sent the body
+ * as is.
+ **/
+static Encoding negotiate_variant(Request *r, FileEntry *entry, const char *body, size_t size,
+                                  const char **variant, size_t *length, char **owned) {
+    Encoding encoding = encoding_negotiate(request_header(r, HEADER_ACCEPT_ENCODING), COMPRESS_ENCODINGS);
+
+    *owned = NULL;
+    if (encoding == ENCODING_IDENTITY) {
+        return encoding;
+    }
+
+    *variant = file_cache_variant(entry, encoding, length);
+    if (*variant == NULL && size <= COMPRESS_INLINE_MAX) {
+        *variant = *owned = body ? compress_data(encoding, body, size, length) : compress_entry(entry, encoding, length);
+        if (*owned && file_cache_store(entry, encoding, *owned, *length)) {
+            *owned = NULL;
+        }
+    } else if (*variant == NULL && body == NULL) {
+        compress_queue(entry, encoding);
+    }
+
+    if (*variant == NULL || *length >= size) {  /* Incompressible */
+        free(*owned);
+        *owned = NULL;
+        return ENCODING_IDENTITY;
+    }
+    return encoding;
+}
+
+/**
+ * Render directory listing in HTML, followed by its headers.
  *
- * This lists the contents of a directory in HTML.
+ * @param   r           HTTP Request structure.
+ * @param   length      Number of bytes in listing (set).
+ * @param   headers_length  Number of bytes in headers (set).
+ * @return  Listing and headers, allocated with malloc (or NULL on error).
  *
- * If the path cannot be opened or scanned as a directory, then handle error
- * with HTTP_STATUS_NOT_FOUND.
+ * The headers are rendered by response_headers right after the listing, so
+ * a cached listing is sent like a file held in memory.
  **/
-Status  handle_browse_request(Request *r) {
+static char * render_listing(Request *r, size_t *length, size_t *headers_length) {
     struct dirent **entries;
+    char  *body = NULL;
+    size_t size = 0;
+    FILE  *bs;
     int n;
 
     /* Open a directory for reading or scanning */
     n = scandir(r->path, &entries, NULL, alphasort);
     if(n == -1){
         fprintf(stderr, "scandir failure \n");
-        handle_error(r, HTTP_STATUS_NOT_FOUND);
-        return HTTP_STATUS_NOT_FOUND; 
+        return NULL;
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    /* Render listing into memory first, since its length precedes it */
+    bs = open_memstream(&body, &size);
+    if(bs == NULL){
+        fprintf(stderr, "open_memstream failure: %s\n", strerror(errno));
+        for(int i = 0; i < n; i++){
+            free(entries[i]);
+        }
+        free(entries);
+        return NULL;
+    }
 
     /* For each entry in directory, emit HTML list item */
-    fprintf(r->file, "<ul>\n");
+    const char *prefix = streq(r->uri, "/") ? "" : r->uri;
+    fputs("<ul>\n", bs);
 
     int i = 0;
     while(n > i){
         if(!streq(".", entries[i]->d_name)){ //Prints all direcories outside of the current
-             fprintf(r->file, "<li><a href=\"%s/%s\">%s</li>\n",streq(r->uri,"/") ? "": r->uri, entries[i]->d_name ,entries[i]->d_name);
+             fprintf(bs, "<li><a href=\"%s/%s\">%s</li>\n", prefix, entries[i]->d_name, entries[i]->d_name);
         }
         free(entries[i]);
         i++;
     }
 
-    fprintf(r->file, "</ul>\n");
-    /* Flush socket, return OK */
+    fputs("</ul>\n", bs);
     free(entries);
-    fflush(r->file);
+
+    /* Render headers after listing */
+    char headers[BUFSIZ];
+    fflush(bs);
+    *length         = size;
+    *headers_length = response_headers(headers, sizeof(headers), "text/html", size,
+                                       compress_eligible("text/html", size) ? ENCODING_IDENTITY : ENCODING_NONE);
+    fputs(headers, bs);
+    fclose(bs);
+    return body;
+}
+
+/**
+ * Handle browse request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP browse request.
+ *
+ * This lists the contents of a directory in HTML.  The rendered listing is
+ * kept by the file cache along with its headers, until the directory changes
+ * (an entry is added, removed, or renamed), so most requests are sent from
+ * memory in one write without reading the directory.  A listing is
+ * compressed (and the result kept) if the client accepts it.
+ *
+ * If the path cannot be opened or scanned as a directory, then handle error
+ * with HTTP_STATUS_NOT_FOUND.
+ **/
+Status  handle_browse_request(Request *r) {
+    FileEntry  *entry   = r->entry;
+    const char *content = file_cache_content(entry);
+    bool        held    = content != NULL;
+    char       *body    = NULL;
+    size_t      length  = held ? entry->content_length : 0;
+
+    /* Render listing unless it is cached, and keep it if possible */
+    if (!held) {
+        size_t headers_length;
+        content = body = render_listing(r, &length, &headers_length);
+        if (body == NULL) {
+            handle_error(r, HTTP_STATUS_NOT_FOUND);
+            return HTTP_STATUS_NOT_FOUND;
+        }
+        if (file_cache_store_content(entry, body, length, headers_length)) {
+            held = true;
+            body = NULL;
+        }
+    }
+
+    /* Negotiate encoding and look up (or make) compressed listing */
+    Encoding    encoding = ENCODING_NONE;
+    const char *variant  = NULL;
+    char       *owned    = NULL;
+    size_t      clength  = 0;
+    if (compress_eligible("text/html", length)) {
+        encoding = negotiate_variant(r, entry, held ? NULL : content, length, &variant, &clength, &owned);
+    }
+
+    /* Send HTTP Header with OK Status and text/html Content-Type, followed by
+     * listing, and return OK */
+    if (encoding < ENCODING_IDENTITY) {
+        response_start_encoded(r, HTTP_STATUS_OK, "text/html", clength, encoding);
+        response_append(r, variant, clength);
+    } else if (held) {
+        response_start_entry(r, entry);
+    } else {
+        response_start_encoded(r, HTTP_STATUS_OK, "text/html", length, encoding);
+        response_append(r, content, length);
+    }
+    response_send(r);
+    free(owned);
+    free(body);
 
     return HTTP_STATUS_OK;
 }
@@ -136,55 +279,114 @@ Status  handle_browse_request(Request *r) {
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This opens and streams the contents of the specified file to the socket.
+ * If the file has precompressed sidecars (ie. foo.js.br next to foo.js),
+ * the best encoding the client accepts is sent in its place, under the
+ * file's own Content-Type.  Otherwise, a compressible file is compressed on
+ * the fly and the result is kept by the file cache: up to COMPRESS_INLINE_MAX
+ * bytes by this thread, and larger files by a compression worker, while this
+ * request (and any before the worker is done) is sent the file as is.
  *
- * If the path cannot be opened for reading, then handle error with
- * HTTP_STATUS_NOT_FOUND.
+ * A small file held in memory by the file cache is sent along with its
+ * pre-rendered headers in one write.  Otherwise, this attaches the file
+ * opened by the file cache to the response as its body, which is sent to the
+ * socket with sendfile right after the headers.  Its size comes from the
+ * cached metadata, so a cache hit makes no syscalls before sending.
  **/
 Status  handle_file_request(Request *r) {
-    debug("WE ARE IN HANDLE_FILE_REQUEST RIGHT NOW!");
-    FILE *fs;
-    char buffer[BUFSIZ];
-    char *mimetype = NULL;
-    size_t nread;
-
-    /* Open file for reading */
-    fs = fopen(r->path, "r"); 
-
-    if(fs == NULL){
-        fprintf(stderr, "fopen failed: %s", strerror(errno));
-        goto fail;
+    const char *mimetype;
+    FileEntry  *file     = r->entry;
+    Encoding    encoding = ENCODING_NONE;
+    const char *variant  = NULL;
+    char       *owned    = NULL;
+    size_t      length   = 0;
+
+    /* Negotiate encoding and look up its sidecar */
+    if (file->encodings) {
+        encoding = encoding_negotiate(request_header(r, HEADER_ACCEPT_ENCODING), file->encodings);
+        if (encoding != ENCODING_IDENTITY) {
+            char *uri = arena_printf(&r->arena, "%s%s", r->uri, encoding_suffix(encoding));
+            file = uri ? file_cache_get(uri) : NULL;
+            if (file == NULL || file->handler != HANDLER_FILE) {
+                debug("sidecar %s missing", uri);
+                if (file) {
+                    file_cache_release(file);
+                }
+                file     = r->entry;
+                encoding = ENCODING_IDENTITY;
+            }
+        }
+    }
+
+    /* Negotiate encoding and look up (or make) its compressed variant, unless
+     * a sidecar was chosen */
+    if (file == r->entry && file->compressible) {
+        encoding = negotiate_variant(r, file, NULL, file->st.st_size, &variant, &length, &owned);
+    }
+
+    /* Send file from memory */
+    if (file == r->entry && file->content && encoding >= ENCODING_IDENTITY) {
+        response_start_entry(r, file);
+        response_send(r);
+        return HTTP_STATUS_OK;
     }
 
     /* Determine mimetype */
     mimetype = determine_mimetype(r->path);                             //Determines the content type of the file
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\r\n");
-    fprintf(r->file, "Content-Type: %s\r\n", mimetype);
-    fprintf(r->file, "\r\n");
-
-    /* Read from file and write to socket in chunks */
-    while((nread = fread(buffer,sizeof(char), BUFSIZ, fs)) > 0){
-       if( fwrite(buffer, sizeof(char), nread, r->file) != nread){
-            goto fail;
-        }
+    /* Send HTTP Headers with OK status and determined Content-Type, followed
+     * by file (or its sidecar or compressed variant) */
+    if (file == r->entry && encoding < ENCODING_IDENTITY) {
+        response_start_encoded(r, HTTP_STATUS_OK, mimetype, length, encoding);
+        response_append(r, variant, length);
+        response_send(r);
+        free(owned);
+        return HTTP_STATUS_OK;
     }
 
+    response_start_encoded(r, HTTP_STATUS_OK, mimetype, file->st.st_size, encoding);
+    if (file->content) {
+        response_append(r, file->content, file->content_length);
+    } else {
+        response_attach_entry(r, file);
+    }
+    response_send(r);
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    fflush(r->file);
-    free(mimetype);
-
+    if (file != r->entry) {
+        file_cache_release(file);
+    }
     return HTTP_STATUS_OK;
+}
 
-fail:
-    /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
-    fclose(fs);
-    free(mimetype);
+/**
+ * Set variable in CGI environment.
+ *
+ * @param   arena       Arena the variable is allocated from.
+ * @param   envp        NULL-terminated array of NAME=VALUE strings.
+ * @param   size        Number of variables in envp (updated on append).
+ * @param   name        Name of variable.
+ * @param   value       Value of variable.
+ * @return  -1 on error and 0 on success.
+ *
+ * Like setenv(3), an existing variable of the same name is overwritten, but
+ * only the request's private environment array is modified.
+ **/
+int cgi_setenv(Arena *arena, char **envp, size_t *size, const char *name, const char *value) {
+    char *variable = arena_printf(arena, "%s=%s", name, value);
+    if (!variable) {
+        return -1;
+    }
 
-    return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    size_t length = strlen(name);
+    for (size_t i = 0; i < *size; i++) {
+        if (strncmp(envp[i], name, length) == 0 && envp[i][length] == '=') {
+            envp[i] = variable;
+            return 0;
+        }
+    }
+
+    envp[(*size)++] = variable;
+    envp[*size]     = NULL;
+    return 0;
 }
 
 /**
@@ -193,62 +395,132 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
+ * This spawns and streams the results of the specified executables to the
  * socket.
  *
- * If the path cannot be popened, then handle error with
+ * If the path cannot be spawned, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
+ *
+ * An event loop connection sends its output buffer only once the handler
+ * returns, so there the script's output is buffered whole.  A script writing
+ * more than CGI_OUTPUT_MAX bytes is killed, and its output replaced with
+ * HTTP_STATUS_BAD_GATEWAY.
  **/
 Status  handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
+    /* Scripts write their own headers without a Content-Length, so the end
+     * of the response is marked by closing the connection */
+    r->keepalive = false;
+
+    /* Copy server environment for script, leaving room for CGI variables.
+     * setenv(3) is not used since it modifies environ for every thread. */
+    size_t size = 0;
+    while (environ[size]) {
+        size++;
+    }
+
+    char **envp = arena_alloc(&r->arena, (size + CGI_VARIABLES_MAX + 1) * sizeof(char *));
+    if (envp == NULL) {
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Variables are only replaced, never modified, so they are shared */
+    size_t capacity = size + CGI_VARIABLES_MAX;
+    for (size = 0; environ[size]; size++) {
+        envp[size] = environ[size];
+    }
+    envp[size] = NULL;
 
     /* Export CGI environment variables from request:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
-    setenv("DOCUMENT_ROOT", RootPath, 1);
-    setenv("QUERY_STRING", r->query, 1);
-    setenv("REMOTE_ADDR", r->host, 1);
-    setenv("REMOTE_PORT", r->port, 1);
-    setenv("REQUEST_METHOD", r->method, 1);
-    setenv("REQUEST_URI", r->uri, 1);
-    setenv("SCRIPT_FILENAME", r->path, 1);
-    setenv("SERVER_PORT", Port, 1);
-
-    /* Export CGI environment variables from request headers */
-    Header * curr = r->headers;
-
-    while(curr){
-        if(streq(curr->name,"Host"))
-            setenv("HTTP_HOST", curr->value, 1);
-        if(streq(curr->name,"User-Agent"))
-            setenv("HTTP_USER_AGENT", curr->value ,1);
-        if(streq(curr->name,"Accept"))
-            setenv("HTTP_ACCEPT", curr->value, 1);
-        if(streq(curr->name,"Accept-Language"))
-            setenv("HTTP_ACCEPT_LANGUAGE", curr->value ,1);
-        if(streq(curr->name,"Accept-Encoding"))
-            setenv("HTTP_ACCEPT_ENCODING", curr->value, 1);
-        if(streq(curr->name,"Connection"))
-            setenv("HTTP_CONNECTION", curr->value, 1);
-
-        curr = curr->next;
-        
+    cgi_setenv(&r->arena, envp, &size, "DOCUMENT_ROOT", RootPath);
+    cgi_setenv(&r->arena, envp, &size, "QUERY_STRING", r->query);
+    cgi_setenv(&r->arena, envp, &size, "REMOTE_ADDR", r->host);
+    cgi_setenv(&r->arena, envp, &size, "REMOTE_PORT", r->port);
+    cgi_setenv(&r->arena, envp, &size, "REQUEST_METHOD", r->method);
+    cgi_setenv(&r->arena, envp, &size, "REQUEST_URI", r->uri);
+    cgi_setenv(&r->arena, envp, &size, "SCRIPT_FILENAME", r->path);
+    cgi_setenv(&r->arena, envp, &size, "SERVER_PORT", Port);
+
+    /* Export CGI environment variables from well-known request headers */
+    for (HeaderField field = 0; field < HEADER_FIELDS && size < capacity; field++) {
+        const char *value = request_header(r, field);
+        if (value) {
+            cgi_setenv(&r->arena, envp, &size, header_cgi_variable(field), value);
+        }
+    }
+
+    /* Spawn CGI Script with its stdout connected to a pipe */
+    int pipefd[2];
+    if(pipe2(pipefd, O_CLOEXEC) < 0){
+        fprintf(stderr, "pipe2 failure: %s\n", strerror(errno));
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
-    /* POpen CGI Script */
-    pfs = popen(r->path, "r");              //
-    if(pfs == NULL){
-        fprintf(stderr, "popen failure");
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+
+    /* The server ignores SIGPIPE, but a script should die of it as usual */
+    posix_spawnattr_t attributes;
+    sigset_t          defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF);
+
+    pid_t pid;
+    char *argv[] = {r->path, NULL};
+    int error = posix_spawn(&pid, r->path, &actions, &attributes, argv, envp);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+
+    if(error){
+        fprintf(stderr, "posix_spawn failure: %s\n", strerror(error));
+        close(pipefd[0]);
         return HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
 
-    /* Copy data from popen to socket */
-    while((fgets(buffer, BUFSIZ, pfs))){
-        fputs(buffer, r->file);
+    /* Copy data from script to socket through output buffer (after any
+     * responses pipelined ahead of this one) */
+    size_t start  = r->output.length;
+    Status result = HTTP_STATUS_OK;
+    while (true) {
+        char *space = buffer_reserve(&r->output, BUFSIZ);
+        if (space == NULL) {
+            fprintf(stderr, "buffer_reserve failure: %s\n", strerror(errno));
+            break;
+        }
+
+        ssize_t nread = read(pipefd[0], space, BUFSIZ);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+
+        buffer_commit(&r->output, nread);
+        if (r->connection && r->output.length - start > CGI_OUTPUT_MAX) {
+            fprintf(stderr, "CGI output exceeds %d bytes\n", CGI_OUTPUT_MAX);
+            kill(pid, SIGKILL);
+            r->output.length = start;
+            result = HTTP_STATUS_BAD_GATEWAY;
+            break;
+        }
+        if (response_flush(r) < 0) {
+            break;
+        }
     }
 
-    /* Close popen, flush socket, return OK */
-    pclose(pfs);
-    fflush(r->file);
+    /* Close pipe and reap script */
+    close(pipefd[0]);
+    waitpid(pid, NULL, 0);
+
+    if (result != HTTP_STATUS_OK) {
+        return handle_error(r, result);
+    }
     return HTTP_STATUS_OK;
 }
 
@@ -259,23 +531,24 @@ Status  handle_cgi_request(Request *r) {
  * @return  Status of the HTTP error request.
  *
  * This writes an HTTP status error code and then generates an HTML message to
- * notify the user of the error.
+ * notify the user of the error.  The request may not have a path (ie. if it
+ * failed to parse), so only its status is used.
  **/
 Status  handle_error(Request *r, Status status) {
     const char *status_string = http_status_string(status);
+    char body[BUFSIZ];
 
-    /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\n", status_string);
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    /* Write HTML Description of Error */
+    int length = snprintf(body, sizeof(body),
+        "<h1>%s</h1>\r\n"
+        "<h1>Stuff's all borked. I blame nargels</h1>\r\n", status_string);
 
-    /* Write HTML Description of Error*/
-    
-    fprintf(r->file, "<h1>%s</h1>\r\n", status_string);
-    fprintf(r->file, "<h1>Stuff's all borked. I blame nargels</h1>\r\n");
+    /* Send HTTP Header and description */
+    response_start(r, status, "text/html", length);
+    response_append(r, body, length);
+    response_send(r);
 
     /* Return specified status */
-    fflush(r->file);
     return status;
 }
 
@@ -0,0 +1,237 @@
+/* mimetypes.c: Mime Type Table */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+/* Constants */
+
+#define MIMETYPES_CAPACITY_MIN  64
+#define MIMETYPES_EXTENSION_MAX 32      /* Longest extension that is looked up */
+
+/* Mime Type Table */
+
+typedef struct {
+    const char *extension;              /*< Lowercase file extension (NULL if slot is empty) */
+    const char *mimetype;               /*< Mime type of extension */
+} MimeTypeEntry;
+
+typedef struct {
+    char          *data;                /*< Contents of mime.types (entries point into it) */
+    MimeTypeEntry *entries;             /*< Open addressing slots */
+    size_t         capacity;            /*< Number of slots (power of two) */
+    size_t         size;                /*< Number of extensions in table */
+} MimeTypeTable;
+
+static MimeTypeTable         *MimeTypes      = NULL;
+static volatile sig_atomic_t  MimeTypesStale = 0;
+
+/* Table Functions */
+
+/**
+ * Hash lowercase extension with FNV-1a.
+ *
+ * @param   extension   Lowercase file extension.
+ * @return  Hash of extension.
+ **/
+static size_t mimetypes_hash(const char *extension) {
+    size_t hash = 2166136261u;
+
+    for (const char *c = extension; *c; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Find slot of extension, or the empty slot where it belongs.
+ *
+ * @param   table       MimeTypeTable structure.
+ * @param   extension   Lowercase file extension.
+ * @return  Slot of extension in table.
+ **/
+static MimeTypeEntry * mimetypes_slot(MimeTypeTable *table, const char *extension) {
+    size_t mask  = table->capacity - 1;
+    size_t index = mimetypes_hash(extension) & mask;
+
+    while (table->entries[index].extension && !streq(table->entries[index].extension, extension)) {
+        index = (index + 1) & mask;
+    }
+
+    return &table->entries[index];
+}
+
+/**
+ * Read mime.types file into a new table.
+ *
+ * @param   path        Path to mime.types file.
+ * @return  Newly allocated MimeTypeTable (or NULL on error).
+ *
+ * Like the original linear scan, the first mime type listed for an extension
+ * wins.  Extensions are lowercased so lookups are case-insensitive.
+ **/
+static MimeTypeTable * mimetypes_read(const char *path) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        fprintf(stderr, "fopen failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    MimeTypeTable *table = calloc(1, sizeof(MimeTypeTable));
+    long length = -1;
+    if (table && fseek(fs, 0, SEEK_END) == 0 && (length = ftell(fs)) >= 0) {
+        rewind(fs);
+        table->data = malloc(length + 1);
+    }
+
+    if (!table || !table->data || fread(table->data, 1, length, fs) != (size_t)length) {
+        fprintf(stderr, "Unable to read %s: %s\n", path, strerror(errno));
+        fclose(fs);
+        if (table) {
+            free(table->data);
+        }
+        free(table);
+        return NULL;
+    }
+    table->data[length] = 0;
+    fclose(fs);
+
+    /* Size table for at most half full, assuming every word is an extension */
+    size_t words = 0;
+    for (long i = 0; i < length; i++) {
+        words += isspace(table->data[i]) ? 1 : 0;
+    }
+
+    table->capacity = MIMETYPES_CAPACITY_MIN;
+    while (table->capacity < 2 * words) {
+        table->capacity *= 2;
+    }
+
+    table->entries = calloc(table->capacity, sizeof(MimeTypeEntry));
+    if (!table->entries) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        free(table->data);
+        free(table);
+        return NULL;
+    }
+
+    /* Insert each extension of each rule:  <MIMETYPE> <EXT1> <EXT2> ... */
+    char *lineptr;
+    for (char *line = strtok_r(table->data, "\n", &lineptr); line; line = strtok_r(NULL, "\n", &lineptr)) {
+        char *saveptr;
+        char *mimetype = strtok_r(line, WHITESPACE, &saveptr);
+        if (!mimetype || *mimetype == '#') {
+            continue;
+        }
+
+        char *extension;
+        while ((extension = strtok_r(NULL, WHITESPACE, &saveptr))) {
+            for (char *c = extension; *c; c++) {
+                *c = tolower(*c);
+            }
+
+            MimeTypeEntry *entry = mimetypes_slot(table, extension);
+            if (!entry->extension) {
+                entry->extension = extension;
+                entry->mimetype  = mimetype;
+                table->size++;
+            }
+        }
+    }
+
+    return table;
+}
+
+/* Mime Type Functions */
+
+/**
+ * Load MimeTypesPath into the mime type table.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The new table replaces the current one atomically, so concurrent lookups
+ * see either table in full.  A replaced table is never freed, since a
+ * handler may still be using a mime type that points into it; reloads are
+ * rare enough that this does not matter.
+ **/
+int mimetypes_load(void) {
+    MimeTypeTable *table = mimetypes_read(MimeTypesPath);
+    if (!table) {
+        return -1;
+    }
+
+    __atomic_store_n(&MimeTypes, table, __ATOMIC_RELEASE);
+    log("Loaded %zu mime type extensions from %s", table->size, MimeTypesPath);
+    return 0;
+}
+
+/**
+ * Mark mime type table for reload (SIGHUP handler).
+ *
+ * @param   signum      Signal number.
+ *
+ * Loading allocates, so it is not done in the handler; the next call to
+ * mimetypes_refresh does it instead.
+ **/
+void mimetypes_reload(int signum) {
+    MimeTypesStale = 1;
+}
+
+/**
+ * Reload mime type table if SIGHUP arrived since the last refresh.
+ *
+ * Only the caller that clears the flag reloads, so concurrent callers do not
+ * load the file more than once.
+ **/
+void mimetypes_refresh(void) {
+    if (__atomic_exchange_n(&MimeTypesStale, 0, __ATOMIC_ACQ_REL)) {
+        mimetypes_load();
+    }
+}
+
+/**
+ * Determine mime-type from file extension.
+ *
+ * @param   path        Path to file.
+ * @return  Mime-type of the specified file (must not be free'd).
+ *
+ * The extension (after the last '.' of the file name) is lowercased and
+ * looked up in the table loaded from MimeTypesPath.
+ *
+ * If no extension exists or no matching mimetype is found, then return
+ * DefaultMimeType.
+ **/
+const char * determine_mimetype(const char *path) {
+    char extension[MIMETYPES_EXTENSION_MAX];
+
+    mimetypes_refresh();
+
+    /* Find file extension */
+    const char *name = strrchr(path, '/');
+    const char *ext  = strrchr(name ? name : path, '.');
+    if (!ext || strlen(ext + 1) >= sizeof(extension)) {
+        return DefaultMimeType;
+    }
+
+    size_t i = 0;
+    for (ext++; *ext; ext++) {
+        extension[i++] = tolower(*ext);
+    }
+    extension[i] = 0;
+
+    /* Lookup extension */
+    MimeTypeTable *table = __atomic_load_n(&MimeTypes, __ATOMIC_ACQUIRE);
+    if (!table) {
+        return DefaultMimeType;
+    }
+
+    MimeTypeEntry *entry = mimetypes_slot(table, extension);
+    return entry->extension ? entry->mimetype : DefaultMimeType;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
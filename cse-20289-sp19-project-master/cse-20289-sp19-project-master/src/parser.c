@@ -0,0 +1,393 @@
+/* parser.c: Incremental HTTP Request Parser */
+
+#include "spidey.h"
+
+#include <string.h>
+#include <strings.h>
+
+/* Delimiters ending the token of each state that reads one */
+
+static const char *ParserDelimiters[] = {
+    [PARSER_METHOD]      = " \r\n",
+    [PARSER_URI]         = " \r\n",
+    [PARSER_VERSION]     = " \r\n",
+    [PARSER_HEADER_NAME] = ":\r\n",
+    [PARSER_VALUE]       = "\r\n",
+    [PARSER_ERROR]       = NULL,
+};
+
+/* Well-Known Headers */
+
+#define HEADER_SLOTS    32              /* Size of perfect hash table (power of two) */
+
+typedef struct {
+    const char *name;                   /*< Canonical header name */
+    size_t      length;                 /*< Length of name */
+    const char *cgi;                    /*< CGI environment variable of header */
+} HeaderName;
+
+static const HeaderName HeaderNames[HEADER_FIELDS] = {
+    [HEADER_ACCEPT]                     = {"Accept",                    6,  "HTTP_ACCEPT"},
+    [HEADER_ACCEPT_ENCODING]            = {"Accept-Encoding",           15, "HTTP_ACCEPT_ENCODING"},
+    [HEADER_ACCEPT_LANGUAGE]            = {"Accept-Language",           15, "HTTP_ACCEPT_LANGUAGE"},
+    [HEADER_AUTHORIZATION]              = {"Authorization",             13, "HTTP_AUTHORIZATION"},
+    [HEADER_CACHE_CONTROL]              = {"Cache-Control",             13, "HTTP_CACHE_CONTROL"},
+    [HEADER_CONNECTION]                 = {"Connection",                10, "HTTP_CONNECTION"},
+    [HEADER_CONTENT_LENGTH]             = {"Content-Length",            14, "CONTENT_LENGTH"},
+    [HEADER_CONTENT_TYPE]               = {"Content-Type",              12, "CONTENT_TYPE"},
+    [HEADER_COOKIE]                     = {"Cookie",                    6,  "HTTP_COOKIE"},
+    [HEADER_HOST]                       = {"Host",                      4,  "HTTP_HOST"},
+    [HEADER_IF_MODIFIED_SINCE]          = {"If-Modified-Since",         17, "HTTP_IF_MODIFIED_SINCE"},
+    [HEADER_IF_NONE_MATCH]              = {"If-None-Match",             13, "HTTP_IF_NONE_MATCH"},
+    [HEADER_RANGE]                      = {"Range",                     5,  "HTTP_RANGE"},
+    [HEADER_REFERER]                    = {"Referer",                   7,  "HTTP_REFERER"},
+    [HEADER_UPGRADE_INSECURE_REQUESTS]  = {"Upgrade-Insecure-Requests", 25, "HTTP_UPGRADE_INSECURE_REQUESTS"},
+    [HEADER_USER_AGENT]                 = {"User-Agent",                10, "HTTP_USER_AGENT"},
+};
+
+/* Slot of each well-known header (plus one, so 0 is empty) under header_hash.
+ * The hash was chosen so that no two well-known names collide; adding a
+ * header means recomputing these slots (and perhaps the hash). */
+static const unsigned char HeaderSlots[HEADER_SLOTS] = {
+    [23] = HEADER_ACCEPT + 1,
+    [12] = HEADER_ACCEPT_ENCODING + 1,
+    [4]  = HEADER_ACCEPT_LANGUAGE + 1,
+    [6]  = HEADER_AUTHORIZATION + 1,
+    [0]  = HEADER_CACHE_CONTROL + 1,
+    [5]  = HEADER_CONNECTION + 1,
+    [17] = HEADER_CONTENT_LENGTH + 1,
+    [3]  = HEADER_CONTENT_TYPE + 1,
+    [29] = HEADER_COOKIE + 1,
+    [28] = HEADER_HOST + 1,
+    [14] = HEADER_IF_MODIFIED_SINCE + 1,
+    [22] = HEADER_IF_NONE_MATCH + 1,
+    [11] = HEADER_RANGE + 1,
+    [1]  = HEADER_REFERER + 1,
+    [26] = HEADER_UPGRADE_INSECURE_REQUESTS + 1,
+    [15] = HEADER_USER_AGENT + 1,
+};
+
+/**
+ * Hash header name from its length and its first and last characters.
+ *
+ * @param   name        Header name (not empty).
+ * @param   length      Length of name.
+ * @return  Slot of name in HeaderSlots.
+ *
+ * Letters are lowercased by setting bit 0x20, so the hash is case-insensitive
+ * for every well-known name.
+ **/
+static inline size_t header_hash(const char *name, size_t length) {
+    unsigned char first = name[0] | 0x20;
+    unsigned char last  = name[length - 1] | 0x20;
+
+    return (length + first + 4 * last) & (HEADER_SLOTS - 1);
+}
+
+/**
+ * Recognize well-known header name.
+ *
+ * @param   name        Header name.
+ * @param   length      Length of name.
+ * @return  HeaderField of name (or HEADER_UNKNOWN).
+ *
+ * The only candidate is the one in the name's hash slot, so this is one
+ * case-insensitive comparison at most.
+ **/
+HeaderField header_field(const char *name, size_t length) {
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    unsigned char slot = HeaderSlots[header_hash(name, length)];
+    if (slot == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    const HeaderName *known = &HeaderNames[slot - 1];
+    if (known->length != length || strncasecmp(known->name, name, length) != 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    return slot - 1;
+}
+
+/**
+ * Return canonical name of well-known header.
+ *
+ * @param   field       HeaderField (not HEADER_UNKNOWN).
+ * @return  Header name.
+ **/
+const char * header_name(HeaderField field) {
+    return HeaderNames[field].name;
+}
+
+/**
+ * Return CGI environment variable of well-known header.
+ *
+ * @param   field       HeaderField (not HEADER_UNKNOWN).
+ * @return  Variable name (ie. HTTP_USER_AGENT for User-Agent).
+ **/
+const char * header_cgi_variable(HeaderField field) {
+    return HeaderNames[field].cgi;
+}
+
+/**
+ * Look up value of well-known header in request.
+ *
+ * @param   r           Request structure.
+ * @param   field       HeaderField (not HEADER_UNKNOWN).
+ * @return  Header value (or NULL if request did not include it).
+ **/
+const char * request_header(Request *r, HeaderField field) {
+    return r->present & (1u << field) ? r->fields[field].value : NULL;
+}
+
+/* Parser Functions */
+
+/**
+ * Skip token bytes up to next delimiter of current state.
+ *
+ * @param   r           Request structure.
+ *
+ * Tokens are scanned in blocks by scan_delimiters rather than one byte at a
+ * time by the state machine.  Within a header value, the end is moved past
+ * the last skipped byte that is not a space.
+ **/
+static void parser_skip(Request *r) {
+    Parser     *p   = &r->parser;
+    const char *set = ParserDelimiters[p->state];
+    if (!set) {
+        return;
+    }
+
+    size_t skip = scan_delimiters(r->input.data + p->offset, r->input.length - p->offset, set);
+
+    if (p->state == PARSER_VALUE) {
+        for (size_t i = p->offset + skip; i > p->offset; i--) {
+            if (r->input.data[i - 1] != ' ' && r->input.data[i - 1] != '\t') {
+                p->end = i;
+                break;
+            }
+        }
+    }
+
+    p->offset += skip;
+}
+
+/**
+ * Start header once its name is complete.
+ *
+ * @param   r           Request structure.
+ * @return  -1 if there are too many headers and 0 on success.
+ *
+ * A well-known header goes to its slot in fields; anything else, including
+ * a repeated well-known header, goes to headers.
+ **/
+static int parser_name(Request *r) {
+    Parser     *p      = &r->parser;
+    char       *name   = r->input.data + p->mark;
+    size_t      length = p->offset - p->mark;
+    HeaderField field  = header_field(name, length);
+
+    if (field != HEADER_UNKNOWN && !(r->present & (1u << field))) {
+        r->present |= 1u << field;
+        p->header = &r->fields[field];
+    } else if (r->nheaders < REQUEST_HEADERS_MAX) {
+        p->header = &r->headers[r->nheaders++];
+    } else {
+        return -1;
+    }
+
+    r->input.data[p->offset] = 0;
+    p->header->name        = name;
+    p->header->name_length = length;
+    return 0;
+}
+
+/**
+ * Finish current header once its value is complete.
+ *
+ * @param   r           Request structure.
+ *
+ * A Connection header of close or keep-alive overrides the version default.
+ **/
+static void parser_header(Request *r) {
+    Parser *p = &r->parser;
+    Header *h = p->header;
+
+    r->input.data[p->end] = 0;
+    h->value        = r->input.data + p->mark;
+    h->value_length = p->end - p->mark;
+
+    if (h == &r->fields[HEADER_CONNECTION]) {
+        if (strcasecmp(h->value, "close") == 0) {
+            r->keepalive = false;
+        } else if (strcasecmp(h->value, "keep-alive") == 0) {
+            r->keepalive = true;
+        }
+    }
+
+    debug("HTTP HEADER %s = %s", h->name, h->value);
+}
+
+/**
+ * Parse as much of buffered HTTP request as has been received.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error, 0 if more bytes are needed, 1 once request is parsed.
+ *
+ * HTTP Requests come in the form
+ *
+ *  <METHOD> <URI>[?QUERY] HTTP/<VERSION>
+ *  <NAME>: <VALUE>
+ *  ...
+ *  <empty line>
+ *
+ * The parser resumes where it stopped whenever more bytes are appended to the
+ * request buffer, so it never rescans a line or blocks.  Tokens are not
+ * copied: method, uri, query, and headers point into the request buffer,
+ * where each is terminated in place over its delimiter.  The bytes of a token
+ * are skipped with parser_skip, so the state machine only steps through
+ * delimiters.
+ *
+ * Lines may end with CRLF or LF.  A request line without a URI, a header
+ * without a colon, or more than REQUEST_HEADERS_MAX unknown headers is an error.  Once
+ * parsed, rrequest is the length of the request in the buffer.
+ **/
+int parser_execute(Request *r) {
+    Parser *p = &r->parser;
+    char   *b = r->input.data;
+
+    for (; p->offset < r->input.length && p->state < PARSER_DONE; p->offset++) {
+        parser_skip(r);
+        if (p->offset == r->input.length) {
+            break;
+        }
+
+        char c = b[p->offset];
+
+        switch (p->state) {
+            case PARSER_METHOD:
+                if (c == ' ') {
+                    b[p->offset] = 0;
+                    r->method = b + p->mark;
+                    p->state  = PARSER_URI_START;
+                } else if (c == '\r' || c == '\n') {
+                    p->state  = PARSER_ERROR;
+                }
+                break;
+
+            case PARSER_URI_START:
+                if (c == '\r' || c == '\n') {
+                    p->state = PARSER_ERROR;
+                } else if (c != ' ') {
+                    p->mark  = p->offset;
+                    p->state = PARSER_URI;
+                }
+                break;
+
+            case PARSER_URI:
+                if (c == ' ' || c == '\r' || c == '\n') {
+                    b[p->offset] = 0;
+                    r->uri   = b + p->mark;
+                    r->query = strchr(r->uri, '?');
+                    if (r->query) {
+                        *r->query++ = 0;
+                    } else {
+                        r->query = b + p->offset;   /* Empty string */
+                    }
+
+                    if (c == ' ') {
+                        p->state = PARSER_VERSION_START;
+                    } else {
+                        p->state = c == '\r' ? PARSER_REQUEST_LF : PARSER_HEADER_START;
+                    }
+                }
+                break;
+
+            case PARSER_VERSION_START:
+                p->mark = p->offset;
+                if (c != ' ') {
+                    p->state = PARSER_VERSION;
+                }
+                /* fallthrough */
+
+            case PARSER_VERSION:
+                if (c == ' ' || c == '\r' || c == '\n') {
+                    b[p->offset] = 0;
+                    r->keepalive = streq(b + p->mark, "HTTP/1.1");
+                    if (c == '\r') {
+                        p->state = PARSER_REQUEST_LF;
+                    } else if (c == '\n') {
+                        p->state = PARSER_HEADER_START;
+                    }
+                }
+                break;
+
+            case PARSER_REQUEST_LF:
+            case PARSER_HEADER_LF:
+                p->state = c == '\n' ? PARSER_HEADER_START : PARSER_ERROR;
+                break;
+
+            case PARSER_HEADER_START:
+                if (c == '\r') {
+                    p->state = PARSER_END_LF;
+                } else if (c == '\n') {
+                    p->state = PARSER_DONE;
+                } else {
+                    p->mark  = p->offset;
+                    p->state = PARSER_HEADER_NAME;
+                }
+                break;
+
+            case PARSER_HEADER_NAME:
+                if (c == ':') {
+                    p->state = parser_name(r) < 0 ? PARSER_ERROR : PARSER_VALUE_START;
+                } else if (c == '\r' || c == '\n') {
+                    p->state = PARSER_ERROR;
+                }
+                break;
+
+            case PARSER_VALUE_START:
+                if (c == ' ' || c == '\t') {
+                    break;
+                }
+                p->mark  = p->end = p->offset;
+                p->state = PARSER_VALUE;
+                /* fallthrough */
+
+            case PARSER_VALUE:
+                if (c == '\r' || c == '\n') {
+                    parser_header(r);
+                    p->state = c == '\r' ? PARSER_HEADER_LF : PARSER_HEADER_START;
+                } else if (c != ' ' && c != '\t') {
+                    p->end = p->offset + 1;
+                }
+                break;
+
+            case PARSER_END_LF:
+                p->state = c == '\n' ? PARSER_DONE : PARSER_ERROR;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (p->state == PARSER_ERROR) {
+        return -1;
+    }
+
+    if (p->state != PARSER_DONE) {
+        return 0;
+    }
+
+    r->rrequest = p->offset;
+    debug("HTTP METHOD: %s", r->method);
+    debug("HTTP URI:    %s", r->uri);
+    debug("HTTP QUERY:  %s", r->query);
+    return 1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
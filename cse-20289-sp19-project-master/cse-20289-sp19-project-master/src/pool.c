@@ -0,0 +1,150 @@
+/* pool.c: Object Pools */
+
+#include "spidey.h"
+
+#include <signal.h>
+#include <string.h>
+
+/* Pools */
+
+Pool RequestPool    = POOL_INITIALIZER("request", sizeof(Request));
+Pool ConnectionPool = POOL_INITIALIZER("connection", sizeof(Connection));
+
+static volatile sig_atomic_t PoolReport = 0;
+
+/* Pool Functions */
+
+/**
+ * Allocate slab of objects onto free list of pool.
+ *
+ * @param   p           Pool structure (locked).
+ * @return  -1 if pool is at capacity or out of memory and 0 on success.
+ *
+ * A slab holds up to POOL_SLAB_OBJECTS objects, each padded to a multiple of
+ * POOL_ALIGNMENT so neighbouring objects never share a cache line.  Slabs
+ * are zeroed once and never freed; their objects are recycled instead.
+ **/
+static int pool_grow(Pool *p) {
+    size_t size  = (p->size + POOL_ALIGNMENT - 1) & ~(POOL_ALIGNMENT - 1);
+    size_t count = POOL_SLAB_OBJECTS;
+
+    if (MaxConnections && p->allocated + count > MaxConnections) {
+        count = MaxConnections - p->allocated;
+    }
+    if (count == 0) {
+        return -1;
+    }
+
+    char *slab;
+    int   error = posix_memalign((void **)&slab, POOL_ALIGNMENT, count * size);
+    if (error) {
+        fprintf(stderr, "posix_memalign failed: %s\n", strerror(error));
+        return -1;
+    }
+    memset(slab, 0, count * size);
+
+    for (size_t i = 0; i < count; i++) {
+        PoolObject *object = (PoolObject *)(slab + i * size);
+        object->next = p->free;
+        p->free      = object;
+    }
+
+    p->allocated += count;
+    return 0;
+}
+
+/**
+ * Take object from pool.
+ *
+ * @param   p           Pool structure.
+ * @return  Object of pool size (or NULL if pool is exhausted).
+ *
+ * An object from a new slab is zeroed; a recycled object is returned as it
+ * was put back, so callers initialize whatever they need.  At most
+ * MaxConnections objects exist at once (unbounded if it is 0).
+ **/
+void * pool_get(Pool *p) {
+    if (__atomic_exchange_n(&PoolReport, 0, __ATOMIC_ACQ_REL)) {
+        pool_log(&RequestPool);
+        pool_log(&ConnectionPool);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (!p->free && pool_grow(p) < 0) {
+        p->exhausted++;
+        pthread_mutex_unlock(&p->lock);
+        log("%s pool exhausted (%zu in use)", p->name, p->in_use);
+        return NULL;
+    }
+
+    PoolObject *object = p->free;
+    p->free = object->next;
+    p->in_use++;
+    if (p->in_use > p->peak) {
+        p->peak = p->in_use;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return object;
+}
+
+/**
+ * Return object to pool for reuse.
+ *
+ * @param   p           Pool structure.
+ * @param   object      Object taken from pool (ignored if NULL).
+ **/
+void pool_put(Pool *p, void *object) {
+    if (!object) {
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    ((PoolObject *)object)->next = p->free;
+    p->free = object;
+    p->in_use--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Read occupancy counters of pool.
+ *
+ * @param   p           Pool structure.
+ * @param   counters    PoolCounters structure to fill.
+ **/
+void pool_counters(Pool *p, PoolCounters *counters) {
+    pthread_mutex_lock(&p->lock);
+    counters->in_use    = p->in_use;
+    counters->peak      = p->peak;
+    counters->allocated = p->allocated;
+    counters->capacity  = MaxConnections;
+    counters->exhausted = p->exhausted;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Log occupancy counters of pool.
+ *
+ * @param   p           Pool structure.
+ **/
+void pool_log(Pool *p) {
+    PoolCounters counters;
+
+    pool_counters(p, &counters);
+    log("%s pool: %zu in use (peak %zu), %zu allocated of %zu, exhausted %zu times",
+        p->name, counters.in_use, counters.peak, counters.allocated, counters.capacity, counters.exhausted);
+}
+
+/**
+ * Mark pool counters for logging (SIGUSR1 handler).
+ *
+ * @param   signum      Signal number.
+ *
+ * Logging is not async-signal-safe, so the counters are logged by the next
+ * pool_get instead (ie. when the next client is accepted).
+ **/
+void pool_report(int signum) {
+    PoolReport = 1;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
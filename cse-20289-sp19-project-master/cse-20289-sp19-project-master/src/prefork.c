@@ -0,0 +1,139 @@
+/* prefork.c: Pre-Forked HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Worker Processes */
+
+static pid_t  *PreforkWorkers  = NULL;  /* Process IDs of workers (0 if exited) */
+static size_t  PreforkNWorkers = 0;     /* Number of worker slots */
+
+/**
+ * Forward SIGHUP or SIGUSR1 to every worker, so each reloads its mime types or
+ * logs its pools.
+ *
+ * @param   signum      Signal number.
+ **/
+static void prefork_forward(int signum) {
+    for (size_t i = 0; i < PreforkNWorkers; i++) {
+        if (PreforkWorkers[i] > 0) {
+            kill(PreforkWorkers[i], signum);
+        }
+    }
+}
+
+/**
+ * Fork worker process that serves requests on its own listening socket.
+ *
+ * @param   port        Port number to listen on.
+ * @return  Process ID of worker (or -1 if fork failed).
+ *
+ * Every worker binds its socket with SO_REUSEPORT, so the kernel spreads
+ * incoming connections across the workers.  Each also watches RootPath for
+ * its own file cache.
+ **/
+static pid_t prefork_worker(const char *port) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+    } else if (pid == 0) {
+        /* Exit along with supervisor, reload mime types on SIGHUP, and log
+         * pools on SIGUSR1 */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGHUP, mimetypes_reload);
+        signal(SIGUSR1, pool_report);
+        watch_start(RootPath);
+
+        int sfd = socket_listen(port, true);
+        if (sfd < 0) {
+            fprintf(stderr, "socket_listen failure %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        exit(single_server(sfd));
+    }
+
+    return pid;
+}
+
+/**
+ * Supervise a fixed number of long-lived worker processes.
+ *
+ * @param   port        Port number for workers to listen on.
+ * @return  Exit status of server (EXIT_FAILURE once no workers remain).
+ *
+ * Workers are forked once at startup and handle requests one at a time.
+ * A worker killed by a signal (ie. it crashed) is replaced, while one that
+ * exits on its own (ie. it could not listen) is not.  SIGHUP and SIGUSR1 are
+ * forwarded to the workers.
+ **/
+int prefork_server(const char *port) {
+    size_t nworkers = Workers ? Workers : sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t *workers  = calloc(nworkers, sizeof(pid_t));
+    size_t running  = 0;
+
+    if (!workers) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Fork workers */
+    for (size_t i = 0; i < nworkers; i++) {
+        if ((workers[i] = prefork_worker(port)) > 0) {
+            running++;
+        }
+    }
+    log("Forked %zu of %zu workers", running, nworkers);
+
+    PreforkWorkers  = workers;
+    PreforkNWorkers = nworkers;
+    signal(SIGHUP, prefork_forward);
+    signal(SIGUSR1, prefork_forward);
+
+    /* Restart workers that crash */
+    while (running > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        size_t i = 0;
+        while (i < nworkers && workers[i] != pid) {
+            i++;
+        }
+        if (i == nworkers) {
+            continue;
+        }
+
+        if (WIFSIGNALED(status)) {
+            log("Worker %d killed by signal %d, restarting", pid, WTERMSIG(status));
+            if ((workers[i] = prefork_worker(port)) > 0) {
+                continue;
+            }
+        } else {
+            log("Worker %d exited with status %d", pid, WEXITSTATUS(status));
+            workers[i] = 0;
+        }
+        running--;
+    }
+
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    free(workers);
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,110 @@
+/* queue.c: Bounded Work Queue */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * Initialize bounded work queue.
+ *
+ * @param   q           Queue structure.
+ * @param   capacity    Maximum number of items held by queue.
+ * @return  -1 on error and 0 on success.
+ **/
+int queue_init(Queue *q, size_t capacity) {
+    q->items = calloc(capacity, sizeof(void *));
+    if (!q->items) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    q->capacity = capacity;
+    q->head     = 0;
+    q->size     = 0;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+/**
+ * Deallocate bounded work queue.
+ *
+ * @param   q           Queue structure.
+ *
+ * Any items still in the queue are not freed.
+ **/
+void queue_destroy(Queue *q) {
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+/**
+ * Add item to tail of queue, waiting while the queue is full.
+ *
+ * @param   q           Queue structure.
+ * @param   item        Item to add.
+ **/
+void queue_push(Queue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->size == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+
+    q->items[(q->head + q->size) % q->capacity] = item;
+    q->size++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Add item to tail of queue unless the queue is full.
+ *
+ * @param   q           Queue structure.
+ * @param   item        Item to add.
+ * @return  Whether item was added.
+ *
+ * This is for producers that must not block (ie. event loops).
+ **/
+bool queue_try_push(Queue *q, void *item) {
+    pthread_mutex_lock(&q->lock);
+    if (q->size == q->capacity) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+
+    q->items[(q->head + q->size) % q->capacity] = item;
+    q->size++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+/**
+ * Remove item from head of queue, waiting while the queue is empty.
+ *
+ * @param   q           Queue structure.
+ * @return  Item removed from queue.
+ **/
+void * queue_pop(Queue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->size == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->size--;
+
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -1,79 +1,191 @@
 /* request.c: HTTP Request Functions */
 
+#define _GNU_SOURCE
+
 #include "spidey.h"
 
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 
-int parse_request_method(Request *r);
-int parse_request_headers(Request *r);
+/* Body Functions */
+
+/**
+ * Send file body to client with sendfile.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   body        Body structure (advanced, and closed once sent).
+ * @return  -1 on error, 0 if more remains to be sent, 1 if body is sent.
+ *
+ * The file is copied to the socket by the kernel; on a non-blocking socket,
+ * this returns 0 once the socket is full and can be called again later.
+ * Bytes are sent from the body's own offset, since a cached file descriptor
+ * is shared by every request for the file.
+ *
+ * On a blocking socket, a client reading just enough to keep each sendfile
+ * from timing out would hold the caller indefinitely, so sending fails once
+ * it has taken over SEND_TIMEOUT seconds at less than SEND_RATE_MIN.
+ **/
+int send_body(int fd, Body *body) {
+    uint64_t start = timer_now();
+    size_t   sent  = 0;
+
+    while (body->length > 0) {
+        ssize_t nsent = sendfile(fd, body->fd, &body->offset, body->length);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            debug("sendfile failed: %s", strerror(errno));
+            return -1;
+        }
+        if (nsent == 0) {
+            debug("sendfile failed: file truncated");
+            return -1;
+        }
+
+        body->length -= nsent;
+        sent         += nsent;
+
+        uint64_t elapsed = timer_now() - start;
+        if (elapsed > SEND_TIMEOUT * 1000 && sent < SEND_RATE_MIN * elapsed / 1000) {
+            debug("sendfile failed: client too slow");
+            return -1;
+        }
+    }
+
+    close_body(body);
+    return 1;
+}
+
+/**
+ * Close file body, sent or not.
+ *
+ * @param   body        Body structure.
+ *
+ * A file owned by the body is closed; a cached file is released to the file
+ * cache instead.
+ **/
+void close_body(Body *body) {
+    if (body->entry) {
+        file_cache_release(body->entry);
+    } else if (body->fd >= 0) {
+        close(body->fd);
+    }
+
+    body->fd     = -1;
+    body->offset = 0;
+    body->length = 0;
+    body->entry  = NULL;
+}
+
+/* Request Functions */
+
+/**
+ * Take request struct from pool for accepted client socket.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   addr        Client socket address.
+ * @param   addrlen     Length of client socket address.
+ * @return  Request structure from RequestPool (or NULL on error).
+ *
+ * The client address is looked up numerically into the request struct.  A
+ * recycled request keeps its socket buffers and the first block of its arena.
+ * On error, the client socket is closed.
+ *
+ * Nagle's algorithm is disabled on the client socket: responses are already
+ * coalesced by the output buffer and MSG_MORE, so it would only delay the
+ * last packet of each response on a persistent connection.
+ *
+ * The returned request struct must be deallocated using free_request.
+ **/
+Request * create_request(int fd, struct sockaddr *addr, socklen_t addrlen) {
+    Request *r = pool_get(&RequestPool);
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Reset everything but the socket buffers and arena */
+    memset(r, 0, offsetof(Request, input));
+    r->input.offset  = r->input.length  = 0;
+    r->output.offset = r->output.length = 0;
+    r->input.limit   = REQUEST_MAX;
+
+    r->fd      = fd;
+    r->body.fd = -1;
+
+    /* Send each response as soon as it is complete */
+    int on = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        debug("setsockopt failed: %s", strerror(errno));
+    }
+
+    /* Lookup client information */
+    int status = getnameinfo(addr, addrlen, r->host, sizeof(r->host), r->port, sizeof(r->port), NI_NUMERICHOST | NI_NUMERICSERV);
+    if (status != 0) {
+        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(status));
+        free_request(r);
+        return NULL;
+    }
+
+    return r;
+}
 
 /**
  * Accept request from server socket.
  *
  * @param   sfd         Server socket file descriptor.
- * @return  Newly allocated Request structure.
+ * @return  Request structure (or NULL on error).
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Accepts a client connection from the server socket.
+ *  2. Takes a request struct for the client from the request pool.
+ *  3. Returns the request struct.
+ *
+ * The client socket is used directly: requests are received into the input
+ * buffer by parse_request, and responses are sent by response_send and
+ * response_flush.  Sends that make no progress for SEND_TIMEOUT seconds fail,
+ * so a client that stops reading cannot hold its worker forever.
  *
  * The returned request struct must be deallocated using free_request.
  **/
 Request * accept_request(int sfd) {
-    Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
-
-    /* Allocate request struct (zeroed) */
-
-    r = calloc(1, sizeof(Request));
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
 
     /* Accept a client */
-
-    int client_fd = accept(sfd, &raddr, &rlen);
+    int client_fd = accept4(sfd, (struct sockaddr *)&raddr, &rlen, SOCK_CLOEXEC);
     if(client_fd < 0){
         fprintf(stderr, "accept failed: %s\n", strerror(errno));
-        goto fail;
+        return NULL;
     }
 
-    r->fd = client_fd;
-
-    /* Lookup client information */
-
-    if(getnameinfo(&raddr, rlen, r->host, NI_MAXHOST, r->port, NI_MAXSERV, 0) != 0){
-        fprintf(stderr, "getnameinfo failed: %s\n", strerror(errno));
-        goto fail;
+    Request *r = create_request(client_fd, (struct sockaddr *)&raddr, rlen);
+    if (!r) {
+        return NULL;
     }
 
-    /* Open socket stream */
-
-    FILE *client_file = fdopen(client_fd, "w+");
-    if (!client_file){
-        fprintf(stderr, "Unable to fdopen: %s\n", strerror(errno));
-        close(client_fd);
-        goto fail;
+    struct timeval timeout = {.tv_sec = SEND_TIMEOUT};
+    if (setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+        free_request(r);
+        return NULL;
     }
-    
-    r->file = client_file;
-
-    /* Initialize headers to null */
-    r->headers = NULL;
 
     log("Accepted request from %s:%s", r->host, r->port);
     return r;
-
-fail:
-    /* Deallocate request struct */
-    free(r);
-    return NULL;
 }
 
 /**
@@ -83,182 +195,151 @@ fail:
  *
  * This function does the following:
  *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ *  1. Sends any buffered response and closes the client socket.
+ *  2. Releases all allocated strings in request struct.
+ *  3. Returns request struct to the request pool.
+ *
+ * An output buffer grown past BUFSIZ (ie. by a large CGI response) is
+ * released rather than recycled with the request.
  **/
 void free_request(Request *r) {
     if (!r) {
     	return;
     }
 
-    /* Close socket or fd */
+    /* Send any buffered response and close socket */
+    if (!r->connection) {
+        buffer_flush(&r->output, r->fd, 0);
+    }
     close(r->fd);
 
-    /* Free allocated strings */
-    free(r->uri);
-    free(r->method);
-    free(r->query);
-    free(r->path);
-
-    /* Free headers */
-    Header *current = r->headers;
-    Header *next;
-
-    while(current) {            //Goes through the headers LL and frees each of them
-        free(current->name);
-        free(current->value);
-        next = current->next;
-        free(current);
-        current = next;
+    /* Release allocated strings, keeping arena block for next client */
+    reset_request(r);
+    if (r->output.capacity > BUFSIZ) {
+        buffer_free(&r->output);
     }
 
-    /* Free request */
-    free(r);
+    /* Recycle request */
+    pool_put(&RequestPool, r);
 }
 
 /**
- * Parse HTTP Request.
+ * Reset request struct for next request on the same connection.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
  *
- * This function first parses the request method, any query, and then the
- * headers, returning 0 on success, and -1 on error.
+ * This releases everything allocated from the request arena and discards the
+ * parsed request from the input buffer, keeping any bytes received after it
+ * (ie. a pipelined request).  Buffered output is left to be sent.  The client
+ * socket and its information are left intact.
  **/
-int parse_request(Request *r) {
-    /* Parse HTTP Request Method */
-    int status = parse_request_method(r);
-
-    /* Parse HTTP Requet Headers*/
-    if(status != -1){
-        status = parse_request_headers(r); 
+void reset_request(Request *r) {
+    /* Release allocated strings */
+    arena_reset(&r->arena);
+
+    /* Discard parsed request */
+    buffer_consume(&r->input, r->rrequest);
+    buffer_compact(&r->input);
+    r->rrequest = 0;
+    memset(&r->parser, 0, sizeof(Parser));
+
+    r->method    = NULL;
+    r->uri       = NULL;
+    r->query     = NULL;
+    r->path      = NULL;
+    r->present   = 0;
+    r->nheaders  = 0;
+    r->keepalive = false;
+
+    /* Release file cache entry and close unsent body */
+    if (r->entry) {
+        file_cache_release(r->entry);
+        r->entry = NULL;
     }
-
-    return status;
+    close_body(&r->body);
 }
 
 /**
- * Parse HTTP Request Method and URI.
+ * Receive more request bytes from client into input buffer.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
- *
- * HTTP Requests come in the form
- *
- *  <METHOD> <URI>[QUERY] HTTP/<VERSION>
- *
- * Examples:
+ * @param   deadline    When to give up waiting (in timer_now milliseconds).
+ * @return  -1 on error, timeout, or end of file, and 0 on success.
  *
- *  GET / HTTP/1.1
- *  GET /cgi.script?q=foo HTTP/1.0
- *
- * This function extracts the method, uri, and query (if it exists).
+ * Buffered responses are sent first, since the client may be waiting for
+ * them before sending more.  The receive timeout is set to whatever is left
+ * until the deadline, so a request trickled in over many receives still has
+ * to arrive in time.
  **/
-int parse_request_method(Request *r) {
-    char buffer[BUFSIZ];
-    char *method;
-    char *uri;
-    char *query;
-    /* Read line from socket */
-    if(fgets(buffer, BUFSIZ, r->file) == NULL){
-        debug("fgets failed");
-        goto fail;
+static int receive_request(Request *r, uint64_t deadline) {
+    if (buffer_flush(&r->output, r->fd, 0) <= 0) {
+        return -1;
+    }
+
+    uint64_t now = timer_now();
+    if (now >= deadline) {
+        debug("request timed out");
+        return -1;
     }
-    chomp(buffer);
 
-    /* Parse method and uri */
-    method  = strtok(buffer, WHITESPACE);
-    uri     = strtok(NULL,   WHITESPACE);
+    struct timeval timeout = {.tv_sec = (deadline - now) / 1000, .tv_usec = (deadline - now) % 1000 * 1000};
+    if (setsockopt(r->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+        return -1;
+    }
 
-    if(uri == NULL){
-        r->method   = strdup(" "); 
-        r->uri      = strdup(" ");
-        r->query    = strdup(" ");
-        goto fail;
+    ssize_t nread = buffer_fill(&r->input, r->fd);
+    if (nread < 0 && errno == ENOBUFS) {
+        debug("request too large");
     }
 
-    /* Parse query from uri */
-    if(strchr(uri,  '?')){
-        uri     = strtok(uri,   "?");
-        query   = strtok(NULL,  WHITESPACE);
-    } else
-        query   = ""; //Query does not exist
-
-    r->method   = strdup(method); 
-    r->uri      = strdup(uri);
-    r->query    = strdup(query);
-    
-    /* Record method, uri, and query in request struct */
-    debug("HTTP METHOD: %s", r->method);
-    debug("HTTP URI:    %s", r->uri);
-    debug("HTTP QUERY:  %s", r->query);
-
-    return 0;
-
-fail:
-    return -1;
+    return nread > 0 ? 0 : -1;
 }
 
 /**
- * Parse HTTP Request Headers.
+ * Wait for next request on persistent connection.
  *
  * @param   r           Request structure.
- * @return  -1 on error and 0 on success.
- *
- * HTTP Headers come in the form:
+ * @return  Whether another request arrived before the idle timeout.
  *
- *  <NAME>: <VALUE>
- *
- * Example:
+ * This resets the request struct and then, unless the next request is already
+ * buffered, blocks until the client sends more data, closes the connection,
+ * or is idle for KEEPALIVE_TIMEOUT seconds.
+ **/
+bool next_request(Request *r) {
+    reset_request(r);
+
+    return r->input.length > 0 || receive_request(r, timer_now() + KEEPALIVE_TIMEOUT * 1000) == 0;
+}
+
+/**
+ * Parse HTTP Request.
  *
- *  Host: localhost:8888
- *  User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:29.0) Gecko/20100101 Firefox/29.0
- *  Accept: text/html,application/xhtml+xml
- *  Accept-Language: en-US,en;q=0.5
- *  Accept-Encoding: gzip, deflate
- *  Connection: keep-alive
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
  *
- * This function parses the stream from the request socket using the following
- * pseudo-code:
+ * This runs the incremental parser over the input buffer, receiving more
+ * bytes from the client until the request is complete, returning 0 on
+ * success, and -1 on error (including the request taking longer than
+ * REQUEST_TIMEOUT seconds to arrive).
  *
- *  while (buffer = read_from_socket() and buffer is not empty):
- *      name, value = buffer.split(':')
- *      header      = new Header(name, value)
- *      headers.append(header)
+ * Event loops only handle requests the parser has already finished (or
+ * failed), so this never receives for them.
  **/
-int parse_request_headers(Request *r) {
-    char buffer[BUFSIZ];
-    char *name;
-    char *value;
-
-    /* Parse headers from socket */
-    while(fgets(buffer, BUFSIZ, r->file) && strlen(buffer) > 2){
-        chomp(buffer);
-        name    = strtok(buffer, ":");
-        value   = strtok(NULL, WHITESPACE);
-
-        if(name == NULL || value == NULL){
-            goto fail;
-        }
-
-        struct header *new  = calloc(1, sizeof(struct header));
-        new->value   = strdup(value);
-        new->name    = strdup(name);
-        new->next    = r->headers;
-        r->headers   = new;
-    }
+int parse_request(Request *r) {
+    uint64_t deadline = 0;
+    int      status;
 
-#ifndef NDEBUG
-    for (struct header *header = r->headers; header; header = header->next) {
-    	debug("HTTP HEADER %s = %s", header->name, header->value);
+    while ((status = parser_execute(r)) == 0) {
+        if (!deadline) {
+            deadline = timer_now() + REQUEST_TIMEOUT * 1000;
+        }
+        if (receive_request(r, deadline) < 0) {
+            return -1;
+        }
     }
-#endif
-    return 0;
 
-fail:
-    return -1;
+    return status < 0 ? -1 : 0;
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
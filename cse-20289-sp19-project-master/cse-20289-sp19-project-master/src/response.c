@@ -0,0 +1,354 @@
+/* response.c: HTTP Response Builder */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Constants */
+
+#define FRAGMENT(s)     {(s), sizeof(s) - 1}
+
+typedef struct {
+    const char *data;                   /*< Pre-serialized response bytes */
+    size_t      length;                 /*< Number of bytes in data */
+} Fragment;
+
+/* Status lines (indexed by Status) */
+static const Fragment StatusFragments[] = {
+    FRAGMENT("HTTP/1.1 200 OK\r\n"),
+    FRAGMENT("HTTP/1.1 400 Bad Request\r\n"),
+    FRAGMENT("HTTP/1.1 404 Not Found\r\n"),
+    FRAGMENT("HTTP/1.1 500 Internal Server Error\r\n"),
+    FRAGMENT("HTTP/1.1 502 Bad Gateway\r\n"),
+};
+
+/* Date and Server headers, followed by the name of the Content-Type header */
+#define DATE_FORMAT     "Date: %a, %d %b %Y %H:%M:%S GMT\r\nServer: spidey\r\nContent-Type: "
+#define DATE_MAX        sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\nServer: spidey\r\nContent-Type: ")
+
+typedef struct {
+    time_t      second;                 /*< Second headers were formatted for */
+    size_t      length;                 /*< Number of bytes in headers */
+    char        headers[DATE_MAX];      /*< Formatted Date and Server headers */
+} DateCache;
+
+static const Fragment ContentLengthFragment = FRAGMENT("\r\nContent-Length: ");
+
+/* Content-Encoding and Vary headers (indexed by Encoding) */
+static const Fragment EncodingFragments[] = {
+    FRAGMENT("\r\nContent-Encoding: br\r\nVary: Accept-Encoding"),
+    FRAGMENT("\r\nContent-Encoding: zstd\r\nVary: Accept-Encoding"),
+    FRAGMENT("\r\nContent-Encoding: gzip\r\nVary: Accept-Encoding"),
+    FRAGMENT("\r\nVary: Accept-Encoding"),
+    FRAGMENT(""),
+};
+
+/* Last header and the empty line ending the headers (indexed by keepalive) */
+static const Fragment ConnectionFragments[] = {
+    FRAGMENT("\r\nConnection: close\r\n\r\n"),
+    FRAGMENT("\r\nConnection: keep-alive\r\n\r\n"),
+};
+
+/* Date Functions */
+
+/**
+ * Return Date and Server headers for the current second.
+ *
+ * @param   length      Number of bytes in headers (set).
+ * @return  Formatted headers (valid until the calling thread's next call).
+ *
+ * The headers are only formatted again once the second changes.  Each thread
+ * keeps its own copy, so a response can refer to it without a lock until it
+ * is sent (or copied into the output buffer) by the same thread.
+ **/
+static const char * response_date(size_t *length) {
+    static __thread DateCache cache;
+    time_t now = time(NULL);
+
+    if (now != cache.second || cache.length == 0) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        cache.length = strftime(cache.headers, sizeof(cache.headers), DATE_FORMAT, &tm);
+        cache.second = now;
+    }
+
+    *length = cache.length;
+    return cache.headers;
+}
+
+/* Response Functions */
+
+/**
+ * Return send flags for headers followed by a file body.
+ *
+ * @param   body        Body structure.
+ * @return  MSG_MORE if a body follows, and 0 otherwise.
+ *
+ * An empty body is never sent, so it must not hold back the headers.
+ **/
+int response_more(const Body *body) {
+    return body->fd >= 0 && body->length > 0 ? MSG_MORE : 0;
+}
+
+/**
+ * Append segment to response by reference.
+ *
+ * @param   r           Request structure.
+ * @param   data        Bytes of segment (must remain valid until sent).
+ * @param   length      Number of bytes in segment.
+ *
+ * Segments past RESPONSE_SEGMENTS_MAX are dropped (which is a bug in the
+ * caller, so it is logged).
+ **/
+void response_append(Request *r, const void *data, size_t length) {
+    Response *response = &r->response;
+
+    if (response->nsegments == RESPONSE_SEGMENTS_MAX) {
+        log("response segments exhausted");
+        return;
+    }
+
+    response->segments[response->nsegments++] = (struct iovec){(void *)data, length};
+    response->length += length;
+}
+
+/**
+ * Start response with status line and headers.
+ *
+ * @param   r           Request structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response body (must remain valid until sent).
+ * @param   length      Content-Length of response body.
+ *
+ * Only the Date, Content-Type, and Content-Length values vary between
+ * responses; everything around them is a pre-serialized fragment, the date is
+ * formatted at most once per second, and the length is formatted into the
+ * response itself.
+ **/
+void response_start(Request *r, Status status, const char *mimetype, size_t length) {
+    response_start_encoded(r, status, mimetype, length, ENCODING_NONE);
+}
+
+/**
+ * Start response with status line and headers for a negotiated encoding.
+ *
+ * @param   r           Request structure.
+ * @param   status      HTTP status of response.
+ * @param   mimetype    Content-Type of response body (must remain valid until sent).
+ * @param   length      Content-Length of response body (as encoded).
+ * @param   encoding    Encoding of response body (ENCODING_NONE if the
+ * resource has a single representation).
+ *
+ * Any negotiated response carries Vary: Accept-Encoding, so that caches
+ * keep each encoding apart (identity included).
+ **/
+void response_start_encoded(Request *r, Status status, const char *mimetype, size_t length, Encoding encoding) {
+    Response   *response = &r->response;
+    char       *end      = response->content_length + sizeof(response->content_length);
+    char       *digits   = end;
+    size_t      date_length;
+    const char *date     = response_date(&date_length);
+
+    do {
+        *--digits = '0' + length % 10;
+        length   /= 10;
+    } while (length);
+
+    response->nsegments = 0;
+    response->length    = 0;
+    response_append(r, StatusFragments[status].data, StatusFragments[status].length);
+    response_append(r, date, date_length);
+    response_append(r, mimetype, strlen(mimetype));
+    response_append(r, ContentLengthFragment.data, ContentLengthFragment.length);
+    response_append(r, digits, end - digits);
+    if (encoding != ENCODING_NONE) {
+        response_append(r, EncodingFragments[encoding].data, EncodingFragments[encoding].length);
+    }
+    response_append(r, ConnectionFragments[r->keepalive].data, ConnectionFragments[r->keepalive].length);
+}
+
+/**
+ * Start OK response for file held by file cache, with the file as its body.
+ *
+ * @param   r           Request structure.
+ * @param   entry       FileEntry structure (with content).
+ *
+ * The Content-Type and Content-Length headers were rendered along with the
+ * content, so only the status line, date, and connection fragments are
+ * added around them.  The content is referenced, not copied, so the caller
+ * must hold a reference to entry until the response is sent.
+ **/
+void response_start_entry(Request *r, FileEntry *entry) {
+    Response   *response = &r->response;
+    size_t      date_length;
+    const char *date     = response_date(&date_length);
+
+    response->nsegments = 0;
+    response->length    = 0;
+    response_append(r, StatusFragments[HTTP_STATUS_OK].data, StatusFragments[HTTP_STATUS_OK].length);
+    response_append(r, date, date_length);
+    response_append(r, entry->headers, entry->headers_length);
+    response_append(r, ConnectionFragments[r->keepalive].data, ConnectionFragments[r->keepalive].length);
+    response_append(r, entry->content, entry->content_length);
+}
+
+/**
+ * Render Content-Type value, Content-Length header, and encoding headers as
+ * response_start_encoded would.
+ *
+ * @param   buffer      Buffer to render into (may be NULL if size is 0).
+ * @param   size        Number of bytes in buffer.
+ * @param   mimetype    Content-Type of response body.
+ * @param   length      Content-Length of response body.
+ * @param   encoding    Encoding of response body.
+ * @return  Number of bytes in rendered headers (like snprintf).
+ **/
+size_t response_headers(char *buffer, size_t size, const char *mimetype, size_t length, Encoding encoding) {
+    return snprintf(buffer, size, "%s%s%zu%s", mimetype, ContentLengthFragment.data, length, EncodingFragments[encoding].data);
+}
+
+/**
+ * Attach file as body of response by reference.
+ *
+ * @param   r           Request structure.
+ * @param   fd          File descriptor of body (closed once sent).
+ * @param   length      Number of file bytes to send.
+ **/
+void response_attach(Request *r, int fd, size_t length) {
+    r->body = (Body){.fd = fd, .length = length};
+}
+
+/**
+ * Attach cached file as body of response by reference.
+ *
+ * @param   r           Request structure.
+ * @param   entry       FileEntry structure (HANDLER_FILE).
+ *
+ * The body holds its own reference to the entry, so the file stays open until
+ * it is sent even if the entry is evicted meanwhile.
+ **/
+void response_attach_entry(Request *r, FileEntry *entry) {
+    file_cache_retain(entry);
+    r->body = (Body){.fd = entry->fd, .length = entry->st.st_size, .entry = entry};
+}
+
+/**
+ * Write buffered output and every segment to client socket with one sendmsg.
+ *
+ * @param   r           Request structure.
+ * @param   flags       Flags for sendmsg (MSG_NOSIGNAL is always added).
+ * @return  -1 on error and 0 on success.
+ *
+ * sendmsg is only repeated if the socket takes part of the response, in
+ * which case the segments are advanced past the bytes sent.
+ **/
+static int response_sendmsg(Request *r, int flags) {
+    Response     *response = &r->response;
+    struct iovec  segments[RESPONSE_SEGMENTS_MAX + 1];
+    struct msghdr message  = {.msg_iov = segments, .msg_iovlen = 0};
+    size_t        remaining = response->length;
+
+    segments[0].iov_base = buffer_peek(&r->output, &segments[0].iov_len);
+    if (segments[0].iov_len > 0) {
+        remaining += segments[0].iov_len;
+        message.msg_iovlen++;
+    }
+    for (size_t i = 0; i < response->nsegments; i++) {
+        segments[message.msg_iovlen++] = response->segments[i];
+    }
+
+    while (remaining > 0) {
+        ssize_t nsent = sendmsg(r->fd, &message, flags | MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("sendmsg failed: %s", strerror(errno));
+            return -1;
+        }
+
+        size_t nbuffered = r->output.length - r->output.offset;
+        buffer_consume(&r->output, (size_t)nsent < nbuffered ? (size_t)nsent : nbuffered);
+
+        remaining -= nsent;
+        while (nsent > 0 && (size_t)nsent >= message.msg_iov->iov_len) {
+            nsent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (nsent > 0) {
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + nsent;
+            message.msg_iov->iov_len -= nsent;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Emit response to client.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * An event loop connection gathers the segments into the output buffer and
+ * sends them (and any attached body) itself.  On a blocking socket, a
+ * response without a body is buffered as well while another request is
+ * already received, so pipelined responses go out together; otherwise the
+ * buffered output and the segments go out in one sendmsg, followed by any
+ * attached body through sendfile (where running out of SEND_TIMEOUT is an
+ * error as well).  The headers are sent with MSG_MORE ahead
+ * of a body, so they share its first packet instead of going out alone; the
+ * last sendfile chunk pushes the whole response.
+ **/
+int response_send(Request *r) {
+    Response *response = &r->response;
+    int       status   = 0;
+
+    if (r->connection || (r->body.fd < 0 && r->input.length > r->rrequest)) {
+        status = buffer_append(&r->output, response->segments, response->nsegments);
+    } else {
+        status = response_sendmsg(r, response_more(&r->body));
+        if (status == 0 && r->body.fd >= 0 && send_body(r->fd, &r->body) <= 0) {
+            status = -1;
+        }
+    }
+
+    /* The client cannot be trusted to read another response */
+    if (status < 0) {
+        r->keepalive = false;
+    }
+
+    response->nsegments = 0;
+    response->length    = 0;
+    return status;
+}
+
+/**
+ * Send buffered output of blocking request to client.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * This is used by handlers that stream a response into the output buffer
+ * (ie. CGI output).  Event loop connections send their output buffer once
+ * the socket is writable, so this leaves it alone.
+ **/
+int response_flush(Request *r) {
+    if (r->connection) {
+        return 0;
+    }
+
+    if (buffer_flush(&r->output, r->fd, 0) <= 0) {
+        r->keepalive = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
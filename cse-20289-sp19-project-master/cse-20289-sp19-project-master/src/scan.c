@@ -0,0 +1,218 @@
+/* scan.c: Delimiter Scanning Kernels */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Kernels */
+
+/**
+ * Find first delimiter one byte at a time.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   set         Delimiters (at most SCAN_SET_MAX characters).
+ * @return  Index of first byte of s in set (or length if there is none).
+ *
+ * Like the vector kernels, unused delimiters repeat the first one.
+ **/
+static size_t scan_scalar(const char *s, size_t length, const char *set) {
+    size_t nset = strlen(set);
+    char   d[SCAN_SET_MAX];
+
+    for (size_t k = 0; k < SCAN_SET_MAX; k++) {
+        d[k] = set[k < nset ? k : 0];
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        if (s[i] == d[0] || s[i] == d[1] || s[i] == d[2] || s[i] == d[3]) {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+#ifdef SCAN_X86
+/**
+ * Find first delimiter 16 bytes at a time with SSE4.2 string compares.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   set         Delimiters (at most SCAN_SET_MAX characters).
+ * @return  Index of first byte of s in set (or length if there is none).
+ *
+ * Only whole blocks within length are loaded; the tail is scanned by
+ * scan_scalar.
+ **/
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const char *s, size_t length, const char *set) {
+    char   padded[16] = {0};
+    size_t nset = strlen(set);
+
+    memcpy(padded, set, nset);
+    __m128i delimiters = _mm_loadu_si128((const __m128i *)padded);
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(s + i));
+        int     index = _mm_cmpestri(delimiters, nset, block, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return i + index;
+        }
+    }
+
+    return i + scan_scalar(s + i, length - i, set);
+}
+
+/**
+ * Find first delimiter 32 bytes at a time with AVX2 byte compares.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   set         Delimiters (at most SCAN_SET_MAX characters).
+ * @return  Index of first byte of s in set (or length if there is none).
+ *
+ * Each delimiter is broadcast once; unused vectors repeat the first one.  The
+ * tail is scanned by scan_sse42.
+ **/
+__attribute__((target("avx2,bmi")))
+static size_t scan_avx2(const char *s, size_t length, const char *set) {
+    size_t  nset = strlen(set);
+    __m256i delimiters[SCAN_SET_MAX];
+
+    for (size_t d = 0; d < SCAN_SET_MAX; d++) {
+        delimiters[d] = _mm256_set1_epi8(set[d < nset ? d : 0]);
+    }
+
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block   = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i matches = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, delimiters[0]), _mm256_cmpeq_epi8(block, delimiters[1])),
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, delimiters[2]), _mm256_cmpeq_epi8(block, delimiters[3])));
+        unsigned mask = _mm256_movemask_epi8(matches);
+        if (mask) {
+            return i + _tzcnt_u32(mask);
+        }
+    }
+
+    return i + scan_sse42(s + i, length - i, set);
+}
+#endif
+
+/* Dispatch */
+
+typedef struct {
+    const char  *name;                  /*< Name of kernel */
+    ScanFunction function;              /*< Kernel entry point */
+    const char  *feature;               /*< CPU feature required (NULL if none) */
+} ScanKernel;
+
+static const ScanKernel ScanKernels[] = {
+#ifdef SCAN_X86
+    {"avx2",    scan_avx2,      "avx2"},
+    {"sse4.2",  scan_sse42,     "sse4.2"},
+#endif
+    {"scalar",  scan_scalar,    NULL},
+};
+
+static size_t scan_resolve(const char *s, size_t length, const char *set);
+
+static ScanFunction Scan = scan_resolve;
+
+/**
+ * Check whether CPU supports kernel.
+ *
+ * @param   kernel      ScanKernel structure.
+ * @return  Whether kernel can run on this CPU.
+ **/
+static bool scan_supported(const ScanKernel *kernel) {
+    if (!kernel->feature) {
+        return true;
+    }
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (streq(kernel->feature, "avx2")) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("sse4.2");
+    }
+    if (streq(kernel->feature, "sse4.2")) {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#endif
+    return false;
+}
+
+/**
+ * Select fastest supported kernel on first scan.
+ *
+ * Threads racing here all store the same kernel, so no lock is needed.
+ **/
+static size_t scan_resolve(const char *s, size_t length, const char *set) {
+    for (size_t k = 0; k < sizeof(ScanKernels) / sizeof(ScanKernels[0]); k++) {
+        if (scan_supported(&ScanKernels[k])) {
+            __atomic_store_n(&Scan, ScanKernels[k].function, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return Scan(s, length, set);
+}
+
+/* Scan Functions */
+
+/**
+ * Find first delimiter in bytes.
+ *
+ * @param   s           Bytes to scan.
+ * @param   length      Number of bytes to scan.
+ * @param   set         Delimiters (at most SCAN_SET_MAX characters, not NUL).
+ * @return  Index of first byte of s in set (or length if there is none).
+ *
+ * The kernel is chosen from the CPU features reported by cpuid the first time
+ * this is called (or by scan_select).
+ **/
+size_t scan_delimiters(const char *s, size_t length, const char *set) {
+    return __atomic_load_n(&Scan, __ATOMIC_RELAXED)(s, length, set);
+}
+
+/**
+ * Look up scan kernel by name.
+ *
+ * @param   name        Name of kernel (avx2, sse4.2, or scalar).
+ * @return  Kernel function (or NULL if unknown or unsupported by this CPU).
+ **/
+ScanFunction scan_kernel(const char *name) {
+    for (size_t k = 0; k < sizeof(ScanKernels) / sizeof(ScanKernels[0]); k++) {
+        if (streq(ScanKernels[k].name, name)) {
+            return scan_supported(&ScanKernels[k]) ? ScanKernels[k].function : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Force scan_delimiters to use named kernel.
+ *
+ * @param   name        Name of kernel (avx2, sse4.2, or scalar).
+ * @return  -1 if kernel is unknown or unsupported and 0 on success.
+ **/
+int scan_select(const char *name) {
+    ScanFunction function = scan_kernel(name);
+    if (!function) {
+        return -1;
+    }
+
+    __atomic_store_n(&Scan, function, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
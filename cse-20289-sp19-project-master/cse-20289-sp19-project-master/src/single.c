@@ -18,9 +18,14 @@ int single_server(int sfd) {
     while (true) {
     	/* Accept request */
         Request *r = accept_request(sfd);
-
-	/* Handle request */
-        handle_request(r);
+        if (!r) {
+            continue;
+        }
+
+	/* Handle requests until client closes or idles */
+        do {
+            handle_request(r);
+        } while (r->keepalive && next_request(r));
 
 	/* Free request */
         free_request(r);
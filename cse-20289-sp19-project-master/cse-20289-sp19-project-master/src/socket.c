@@ -16,12 +16,13 @@
  * Allocate socket, bind it, and listen to specified port.
  *
  * @param   port        Port number to bind to and listen on.
+ * @param   reuseport   Whether other sockets may bind the same port (SO_REUSEPORT).
  * @return  Allocated server socket file descriptor.
  **/
 
 const char *host = NULL;
 
-int socket_listen(const char *port) {
+int socket_listen(const char *port, bool reuseport) {
     /* Lookup server address information */
     struct addrinfo hints = {
         .ai_family = AF_UNSPEC,
@@ -47,6 +48,16 @@ int socket_listen(const char *port) {
             continue;
         }
 
+        /* Set socket options */
+        int on = 1;
+        if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+           (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)){
+            fprintf(stderr, "Unable to setsockopt: %s\n", strerror(errno));
+            close(server_fd);
+            server_fd = -1;
+            continue;
+        }
+
         /* Bind socket */
         if(bind(server_fd, p->ai_addr, p->ai_addrlen) < 0){
             fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
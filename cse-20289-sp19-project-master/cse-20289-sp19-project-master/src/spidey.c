@@ -3,6 +3,7 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -13,6 +14,25 @@ char *Port	      = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+size_t Workers	      = 0;
+size_t MaxConnections = 1024;
+size_t FileCacheEntries = FILE_CACHE_ENTRIES;
+time_t FileCacheValidity = FILE_CACHE_VALIDITY;
+size_t ContentCacheBytes = CONTENT_CACHE_BYTES;
+size_t ContentCacheFileMax = CONTENT_CACHE_FILE_MAX;
+int CompressLevel = COMPRESS_LEVEL;
+size_t CompressMinSize = COMPRESS_MIN_SIZE;
+
+/* Concurrency mode names (indexed by ServerMode) */
+static const char *ServerModeNames[] = {
+    "Single",
+    "Forking",
+    "Epoll",
+    "Threaded",
+    "Prefork",
+    "Uring",
+    "Sharded",
+};
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,14 +41,22 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hbcflmMnprstwz]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -b bytes      Most file bytes held in memory (0 to disable)\n");
+    fprintf(stderr, "    -c mode       Concurrency mode (single, forking, epoll, threaded, prefork, uring, sharded)\n");
+    fprintf(stderr, "    -f files      Most files kept open by file cache (0 to disable)\n");
+    fprintf(stderr, "    -l bytes      Smallest body compressed on the fly\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -n clients    Most clients served at once (0 for unbounded)\n");
     fprintf(stderr, "    -p port       Port to listen on\n");
     fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -s bytes      Largest file held in memory\n");
+    fprintf(stderr, "    -t seconds    Seconds file cache trusts an entry (unless watched)\n");
+    fprintf(stderr, "    -w workers    Number of worker threads, processes, or event loops\n");
+    fprintf(stderr, "    -z level      Level of on-the-fly compression (1-9, 0 to disable)\n");
     exit(status);
 }
 
@@ -40,24 +68,54 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, ContentCacheBytes, FileCacheEntries,
+ * CompressMinSize, MimeTypesPath, DefaultMimeType, MaxConnections, Port,
+ * RootPath, ContentCacheFileMax, FileCacheValidity, Workers, and
+ * CompressLevel if specified.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
     int argind = 1;
     while (argind < argc && strlen(argv[argind]) > 1 && argv[argind][0] == '-') {
         char *arg = argv[argind++];
     	switch (arg[1]) {
+	    case 'b':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	ContentCacheBytes = atoi(argv[argind++]);
+	    	break;
 	    case 'c':
 	    	if (streq(argv[argind], "single")) {
 	    	    *mode = SINGLE;
                 } else if (streq(argv[argind], "forking")) {
 	    	    *mode = FORKING;
+	    	} else if (streq(argv[argind], "epoll")) {
+	    	    *mode = EPOLL;
+	    	} else if (streq(argv[argind], "threaded")) {
+	    	    *mode = THREADED;
+	    	} else if (streq(argv[argind], "prefork")) {
+	    	    *mode = PREFORK;
+	    	} else if (streq(argv[argind], "uring")) {
+	    	    *mode = URING;
+	    	} else if (streq(argv[argind], "sharded")) {
+	    	    *mode = SHARDED;
 	    	} else {
 	    	    return false;
 	    	}
 	    	argind++;
 	    	break;
+	    case 'f':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	FileCacheEntries = atoi(argv[argind++]);
+	    	break;
+	    case 'l':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	CompressMinSize = atoi(argv[argind++]);
+	    	break;
 	    case 'h':
 	    	usage(argv[0], EXIT_SUCCESS);
 	    	break;
@@ -67,12 +125,42 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
 	    case 'M':
 	    	DefaultMimeType = argv[argind++];
 	    	break;
+	    case 'n':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	MaxConnections = atoi(argv[argind++]);
+	    	break;
 	    case 'p':
 	    	Port = argv[argind++];
 	    	break;
 	    case 'r':
 	    	RootPath = argv[argind++];
 	    	break;
+	    case 's':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	ContentCacheFileMax = atoi(argv[argind++]);
+	    	break;
+	    case 't':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	FileCacheValidity = atoi(argv[argind++]);
+	    	break;
+	    case 'w':
+	    	if (atoi(argv[argind]) <= 0) {
+	    	    return false;
+	    	}
+	    	Workers = atoi(argv[argind++]);
+	    	break;
+	    case 'z':
+	    	if (atoi(argv[argind]) < 0) {
+	    	    return false;
+	    	}
+	    	CompressLevel = atoi(argv[argind++]);
+	    	break;
 	    default:
 	        return false;
 	    	break;
@@ -90,11 +178,13 @@ int main(int argc, char *argv[]) {
     int status = EXIT_SUCCESS;                  //status set to success by default
 
     /* Parse command line options */
-    status = parse_options(argc, argv, &mode);
+    if (!parse_options(argc, argv, &mode)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
 
-    /* Listen to server socket */
-    int serverfd = socket_listen(Port);
-    if(serverfd < 0){
+    /* Listen to server socket (prefork workers and sharded loops each listen on their own) */
+    int serverfd = -1;
+    if(mode != PREFORK && mode != SHARDED && (serverfd = socket_listen(Port, false)) < 0){
         fprintf(stderr, "socket_listen failure %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
@@ -106,14 +196,54 @@ int main(int argc, char *argv[]) {
     debug("RootPath        = %s", RootPath);
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
-
-    /* Start either forking or single HTTP server */
-    if(mode == SINGLE)
-        single_server(serverfd);
-    else
-        forking_server(serverfd);
-    
+    debug("MaxConnections  = %zu", MaxConnections);
+    debug("FileCache       = %zu files for %lds", FileCacheEntries, (long)FileCacheValidity);
+    debug("ContentCache    = %zu bytes in files up to %zu", ContentCacheBytes, ContentCacheFileMax);
+    debug("Compression     = level %d from %zu bytes", CompressLevel, CompressMinSize);
+    debug("ConcurrencyMode = %s", ServerModeNames[mode]);
+
+    /* Load mime types (reloaded on SIGHUP) and log pools on SIGUSR1 */
+    mimetypes_load();
+    signal(SIGHUP, mimetypes_reload);
+    signal(SIGUSR1, pool_report);
+
+    /* Writing to a disconnected client (ie. with sendfile, which takes no
+     * MSG_NOSIGNAL) must fail with EPIPE rather than kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Watch RootPath, so the file cache trusts entries until they change.
+     * Forked children serve too few requests to be worth a watcher, and
+     * prefork workers each start their own. */
+    watch_subscribe(RootPath, file_cache_invalidate, NULL);
+    if (mode != FORKING && mode != PREFORK) {
+        watch_start(RootPath);
+    }
+
+    /* Start HTTP server for concurrency mode */
+    switch (mode) {
+        case FORKING:
+            status = forking_server(serverfd);
+            break;
+        case EPOLL:
+            status = epoll_server(serverfd);
+            break;
+        case THREADED:
+            status = threaded_server(serverfd);
+            break;
+        case PREFORK:
+            status = prefork_server(Port);
+            break;
+        case URING:
+            status = uring_server(serverfd);
+            break;
+        case SHARDED:
+            status = sharded_server(Port);
+            break;
+        default:
+            status = single_server(serverfd);
+            break;
+    }
+
     return status;
 }
 
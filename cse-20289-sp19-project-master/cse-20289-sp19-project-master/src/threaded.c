@@ -0,0 +1,80 @@
+/* threaded.c: Thread Pool HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define THREAD_POOL_SIZE    16          /* Default number of worker threads */
+#define WORK_QUEUE_SIZE     128
+
+/**
+ * Handle requests removed from work queue.
+ *
+ * @param   arg         Work queue of accepted requests.
+ * @return  Never returns.
+ **/
+static void * threaded_worker(void *arg) {
+    Queue *queue = arg;
+
+    while (true) {
+        Request *r = queue_pop(queue);
+
+        do {
+            handle_request(r);
+        } while (r->keepalive && next_request(r));
+        free_request(r);
+    }
+
+    return NULL;
+}
+
+/**
+ * Hand incoming HTTP requests to a fixed pool of worker threads.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * The main thread accepts requests and pushes them onto a bounded queue; when
+ * every worker is busy and the queue is full, accepting stalls until a worker
+ * catches up.
+ **/
+int threaded_server(int sfd) {
+    Queue queue;
+    size_t nworkers = Workers ? Workers : THREAD_POOL_SIZE;
+    pthread_t workers[nworkers];
+
+    /* Start worker threads */
+    if (queue_init(&queue, WORK_QUEUE_SIZE) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < nworkers; i++) {
+        int error = pthread_create(&workers[i], NULL, threaded_worker, &queue);
+        if (error) {
+            fatal("pthread_create failed: %s", strerror(error));
+        }
+    }
+
+    /* Accept and queue HTTP requests */
+    while (true) {
+        Request *r = accept_request(sfd);
+        if (!r) {
+            continue;
+        }
+
+        queue_push(&queue, r);
+    }
+
+    /* Close server socket */
+    queue_destroy(&queue);
+    close(sfd);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,247 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <string.h>
+
+/* Constants */
+
+#define TIMER_SLOT_MASK     (TIMER_SLOTS - 1)
+#define TIMER_SPAN          ((uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
+/* Internal Functions */
+
+/**
+ * Link timer into the slot its expiry falls in.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   t           Timer structure (not pending).
+ *
+ * Level 0 holds timers expiring within the next TIMER_SLOTS ticks, one slot
+ * per tick; each level above spans TIMER_SLOTS times as many ticks per slot.
+ * A timer is cascaded down to a lower level when the wheel reaches the start
+ * of its slot.
+ **/
+static void timer_link(TimerWheel *w, Timer *t) {
+    if (t->expires < w->current) {
+        t->expires = w->current;
+    }
+    if (t->expires - w->current >= TIMER_SPAN) {
+        t->expires = w->current + TIMER_SPAN - 1;
+    }
+
+    uint64_t delta = t->expires - w->current;
+    unsigned level = 0;
+    while (delta >= ((uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    unsigned slot = (t->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK;
+
+    t->level = level;
+    t->slot  = slot;
+    t->prev  = NULL;
+    t->next  = w->slots[level][slot];
+    if (t->next) {
+        t->next->prev = t;
+    }
+    w->slots[level][slot]  = t;
+    w->occupied[level]    |= (uint64_t)1 << slot;
+}
+
+/**
+ * Detach every timer in slot.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   level       Level of slot.
+ * @param   slot        Index of slot.
+ * @return  Timers that were in slot (linked through next).
+ **/
+static Timer * timer_detach(TimerWheel *w, unsigned level, unsigned slot) {
+    Timer *head = w->slots[level][slot];
+
+    w->slots[level][slot]  = NULL;
+    w->occupied[level]    &= ~((uint64_t)1 << slot);
+    return head;
+}
+
+/* Timer Functions */
+
+/**
+ * Return current time of monotonic clock in milliseconds.
+ **/
+uint64_t timer_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Initialize empty timer wheel.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   now         Current time in milliseconds (from timer_now).
+ **/
+void timer_wheel_init(TimerWheel *w, uint64_t now) {
+    memset(w, 0, sizeof(TimerWheel));
+    w->current = now / TIMER_TICK_MS;
+}
+
+/**
+ * Schedule timer, replacing any earlier schedule.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   t           Timer structure.
+ * @param   now         Current time in milliseconds (from timer_now).
+ * @param   timeout     Milliseconds until timer expires.
+ *
+ * Expiry is rounded up to the next tick, so a timer never fires early.
+ **/
+void timer_add(TimerWheel *w, Timer *t, uint64_t now, uint64_t timeout) {
+    timer_cancel(w, t);
+
+    t->expires = (now + timeout + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    t->pending = true;
+    timer_link(w, t);
+    w->count++;
+}
+
+/**
+ * Remove timer from wheel (if it is pending).
+ *
+ * @param   w           TimerWheel structure.
+ * @param   t           Timer structure.
+ **/
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (!t->pending) {
+        return;
+    }
+
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        w->slots[t->level][t->slot] = t->next;
+        if (!t->next) {
+            w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+        }
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+
+    t->prev    = t->next = NULL;
+    t->pending = false;
+    w->count--;
+}
+
+/**
+ * Reschedule cancelled timer at the expiry it had.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   t           Timer structure (cancelled after being added).
+ *
+ * This parks a timer while its object is out of the wheel owner's hands.  An
+ * expiry that passed in the meantime fires on the next advance.
+ **/
+void timer_resume(TimerWheel *w, Timer *t) {
+    if (t->pending) {
+        return;
+    }
+
+    t->pending = true;
+    timer_link(w, t);
+    w->count++;
+}
+
+/**
+ * Advance wheel to current time, collecting expired timers.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   now         Current time in milliseconds (from timer_now).
+ * @return  Expired timers (linked through next, no longer pending).
+ *
+ * Each tick first cascades the slots of higher levels that start at it, and
+ * then expires its level 0 slot.  An empty wheel skips straight to now.
+ **/
+Timer * timer_wheel_expire(TimerWheel *w, uint64_t now) {
+    uint64_t tick    = now / TIMER_TICK_MS;
+    Timer   *expired = NULL;
+
+    while (w->current <= tick) {
+        if (w->count == 0) {
+            w->current = tick + 1;
+            break;
+        }
+
+        for (unsigned level = TIMER_LEVELS - 1; level > 0; level--) {
+            unsigned shift = TIMER_LEVEL_BITS * level;
+            if (w->current & (((uint64_t)1 << shift) - 1)) {
+                continue;
+            }
+
+            Timer *t = timer_detach(w, level, (w->current >> shift) & TIMER_SLOT_MASK);
+            while (t) {
+                Timer *next = t->next;
+                timer_link(w, t);
+                t = next;
+            }
+        }
+
+        Timer *t = timer_detach(w, 0, w->current & TIMER_SLOT_MASK);
+        while (t) {
+            Timer *next = t->next;
+            t->prev    = NULL;
+            t->next    = expired;
+            t->pending = false;
+            expired    = t;
+            w->count--;
+            t = next;
+        }
+
+        w->current++;
+    }
+
+    return expired;
+}
+
+/**
+ * Return milliseconds until wheel must next be advanced.
+ *
+ * @param   w           TimerWheel structure.
+ * @param   now         Current time in milliseconds (from timer_now).
+ * @return  Milliseconds until next expiry or cascade (or -1 if wheel is empty).
+ *
+ * A cascade may not expire anything, so this can return earlier than the
+ * next expiry, but never later.
+ **/
+int timer_wheel_timeout(TimerWheel *w, uint64_t now) {
+    if (w->count == 0) {
+        return -1;
+    }
+
+    uint64_t next = UINT64_MAX;
+    for (unsigned level = 0; level < TIMER_LEVELS; level++) {
+        if (!w->occupied[level]) {
+            continue;
+        }
+
+        unsigned shift = TIMER_LEVEL_BITS * level;
+        uint64_t group = w->current >> shift;
+        unsigned first = (group << shift) < w->current ? 1 : 0;
+
+        for (unsigned i = first; i <= TIMER_SLOTS; i++) {
+            if (w->occupied[level] & ((uint64_t)1 << ((group + i) & TIMER_SLOT_MASK))) {
+                uint64_t tick = (group + i) << shift;
+                if (tick < next) {
+                    next = tick;
+                }
+                break;
+            }
+        }
+    }
+
+    uint64_t at = next * TIMER_TICK_MS;
+    return at <= now ? 0 : (int)(at - now);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
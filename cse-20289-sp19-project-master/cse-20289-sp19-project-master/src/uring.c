@@ -0,0 +1,758 @@
+/* uring.c: io_uring HTTP Server */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define URING_ENTRIES       256
+#define URING_READ_SIZE     (64 * 1024)
+#define URING_REPORT_PERIOD 1024        /* Requests between syscall reports */
+#define URING_TIMEOUT       (~0UL)      /* User data of linked timeouts */
+
+/* Submission and Completion Rings */
+
+typedef struct {
+    int                  fd;            /*< io_uring file descriptor */
+
+    unsigned            *sq_head;       /*< Submission queue head (kernel) */
+    unsigned            *sq_tail;       /*< Submission queue tail (user) */
+    unsigned            *sq_mask;       /*< Submission queue index mask */
+    unsigned            *sq_array;      /*< Submission queue index array */
+    struct io_uring_sqe *sqes;          /*< Submission queue entries */
+    unsigned             sq_entries;    /*< Number of submission queue entries */
+    unsigned             sq_pending;    /*< Entries queued since last submit */
+
+    unsigned            *cq_head;       /*< Completion queue head (user) */
+    unsigned            *cq_tail;       /*< Completion queue tail (kernel) */
+    unsigned            *cq_mask;       /*< Completion queue index mask */
+    struct io_uring_cqe *cqes;          /*< Completion queue entries */
+
+    size_t               enters;        /*< Number of io_uring_enter calls */
+    size_t               requests;      /*< Number of requests completed */
+} Uring;
+
+/* Connection Operations */
+
+typedef enum {
+    URING_RECV,                         /*< Receiving request */
+    URING_OPEN,                         /*< Opening requested file */
+    URING_STATX,                        /*< Querying opened file */
+    URING_READ,                         /*< Reading file into write buffer */
+    URING_SEND,                         /*< Sending write buffer */
+} UringOperation;
+
+typedef struct {
+    Connection     *connection;         /*< Buffered client connection */
+    UringOperation  operation;          /*< Operation in flight */
+
+    struct open_how how;                /*< Resolution constraints for open */
+    Body            body;               /*< File being read into write buffer */
+    struct statx    stat;               /*< Metadata of opened file */
+
+    struct __kernel_timespec timeout;   /*< Timeout linked to operation in flight */
+    uint64_t        deadline;           /*< When request must be received by (ms, or 0 until it starts) */
+    uint64_t        since;              /*< When bytes sent (in connection) started counting (ms) */
+} UringConnection;
+
+/* Ring Functions */
+
+/**
+ * Create io_uring instance and map its rings.
+ *
+ * @param   u           Uring structure.
+ * @param   entries     Number of submission queue entries.
+ * @return  -1 on error and 0 on success.
+ **/
+static int uring_init(Uring *u, unsigned entries) {
+    struct io_uring_params params = {0};
+
+    memset(u, 0, sizeof(Uring));
+    u->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (u->fd < 0) {
+        fprintf(stderr, "io_uring_setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = (sq_size > cq_size ? sq_size : cq_size);
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        close(u->fd);
+        return -1;
+    }
+
+    u->sq_head    = (unsigned *)(sq + params.sq_off.head);
+    u->sq_tail    = (unsigned *)(sq + params.sq_off.tail);
+    u->sq_mask    = (unsigned *)(sq + params.sq_off.ring_mask);
+    u->sq_array   = (unsigned *)(sq + params.sq_off.array);
+    u->sq_entries = params.sq_entries;
+
+    u->cq_head    = (unsigned *)(cq + params.cq_off.head);
+    u->cq_tail    = (unsigned *)(cq + params.cq_off.tail);
+    u->cq_mask    = (unsigned *)(cq + params.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * Submit queued entries and wait for completions.
+ *
+ * @param   u           Uring structure.
+ * @param   wait        Minimum number of completions to wait for.
+ * @return  -1 on error and 0 on success.
+ **/
+static int uring_submit(Uring *u, unsigned wait) {
+    while (true) {
+        u->enters++;
+        int n = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            u->sq_pending -= n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+/**
+ * Queue a zeroed submission entry.
+ *
+ * @param   u           Uring structure.
+ * @param   opcode      io_uring operation.
+ * @param   fd          File descriptor operated on.
+ * @param   user_data   Value returned with completion.
+ * @return  Submission entry to fill in.
+ *
+ * Entries are only handed to the kernel by uring_submit, so everything queued
+ * during one pass over the completions goes out in a single io_uring_enter.
+ **/
+static struct io_uring_sqe * uring_prepare(Uring *u, int opcode, int fd, void *user_data) {
+    unsigned tail = *u->sq_tail;
+
+    /* Submission queue is full: flush it before queueing more */
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        uring_submit(u, 0);
+    }
+
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->user_data = (unsigned long)user_data;
+
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+    return sqe;
+}
+
+/* Connection Functions */
+
+/**
+ * Deallocate io_uring connection and any open file.
+ *
+ * @param   u           Uring structure.
+ * @param   uc          UringConnection structure.
+ **/
+static void uring_connection_free(Uring *u, UringConnection *uc) {
+    close_body(&uc->body);
+
+    connection_free(uc->connection);
+    free(uc);
+
+    if (++u->requests % URING_REPORT_PERIOD == 0) {
+        log("%zu requests, %zu io_uring_enter calls (%.2f per request)", u->requests, u->enters, (double)u->enters / u->requests);
+    }
+}
+
+/**
+ * Queue timeout linked to the operation just prepared.
+ *
+ * @param   u           Uring structure.
+ * @param   uc          UringConnection structure.
+ * @param   timeout     Milliseconds until operation is cancelled.
+ *
+ * The operation must have been prepared with IOSQE_IO_LINK, after making room
+ * for both entries with uring_reserve.  The kernel copies the timeout when
+ * the entries are submitted, which is before the operation can complete.
+ **/
+static void uring_link_timeout(Uring *u, UringConnection *uc, uint64_t timeout) {
+    uc->timeout.tv_sec  = timeout / 1000;
+    uc->timeout.tv_nsec = (timeout % 1000) * 1000000;
+
+    struct io_uring_sqe *sqe = uring_prepare(u, IORING_OP_LINK_TIMEOUT, -1, (void *)URING_TIMEOUT);
+    sqe->addr = (unsigned long)&uc->timeout;
+    sqe->len  = 1;
+}
+
+/**
+ * Check that client accepts its responses at SEND_RATE_MIN.
+ *
+ * @param   uc          UringConnection structure.
+ * @param   now         Current time in milliseconds (from timer_now).
+ * @return  Whether connection may keep sending.
+ *
+ * Like an event loop, bytes sent are counted over windows of SEND_TIMEOUT
+ * seconds; a client that accepted enough in a window gets another one.
+ **/
+static bool uring_send_rate(UringConnection *uc, uint64_t now) {
+    Connection *c = uc->connection;
+
+    if (now - uc->since < SEND_TIMEOUT * 1000) {
+        return true;
+    }
+    if (c->sent < SEND_RATE_MIN * SEND_TIMEOUT) {
+        debug("Closing slow connection from %s:%s", c->request->host, c->request->port);
+        return false;
+    }
+
+    uc->since = now;
+    c->sent   = 0;
+    return true;
+}
+
+/**
+ * Make room for an operation and its linked timeout in one submission.
+ *
+ * @param   u           Uring structure.
+ **/
+static void uring_reserve(Uring *u) {
+    if (*u->sq_tail + 2 - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) > u->sq_entries) {
+        uring_submit(u, 0);
+    }
+}
+
+/**
+ * Queue receive of more request bytes into the input buffer.
+ *
+ * @param   u           Uring structure.
+ * @param   uc          UringConnection structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * The receive is linked to a timeout, which cancels it once the client has
+ * been idle for KEEPALIVE_TIMEOUT seconds.  Once a request starts, the
+ * timeout is whatever is left of REQUEST_TIMEOUT instead, so a client
+ * trickling bytes cannot hold the connection forever.
+ **/
+static int uring_recv(Uring *u, UringConnection *uc) {
+    Connection *c = uc->connection;
+    Request    *r = c->request;
+    char   *space = buffer_reserve(&r->input, 1);
+    uint64_t  now = timer_now();
+
+    if (!space) {
+        return -1;
+    }
+
+    if (r->input.length > 0 && uc->deadline == 0) {
+        uc->deadline = now + REQUEST_TIMEOUT * 1000;
+    }
+    if (uc->deadline && now >= uc->deadline) {
+        debug("Closing idle connection from %s:%s", r->host, r->port);
+        return -1;
+    }
+
+    uring_reserve(u);
+
+    struct io_uring_sqe *sqe = uring_prepare(u, IORING_OP_RECV, r->fd, uc);
+    sqe->addr  = (unsigned long)space;
+    sqe->len   = r->input.capacity - r->input.length;
+    sqe->flags = IOSQE_IO_LINK;
+    uc->operation = URING_RECV;
+
+    uring_link_timeout(u, uc, uc->deadline ? uc->deadline - now : KEEPALIVE_TIMEOUT * 1000);
+    return 0;
+}
+
+/**
+ * Queue send of the unsent part of the output buffer.
+ *
+ * @param   u           Uring structure.
+ * @param   uc          UringConnection structure.
+ *
+ * While file chunks remain to be read, the send is marked MSG_MORE so a
+ * partial packet waits for the next chunk instead of going out alone.  The
+ * send is linked to a timeout, which cancels it at the end of the current
+ * SEND_RATE_MIN window (see uring_send_rate).
+ *
+ * @return  -1 if client is too slow and 0 otherwise.
+ **/
+static int uring_send(Uring *u, UringConnection *uc) {
+    Request *r = uc->connection->request;
+    size_t   size;
+    char    *data = buffer_peek(&r->output, &size);
+    uint64_t now  = timer_now();
+
+    if (!uring_send_rate(uc, now)) {
+        return -1;
+    }
+
+    uring_reserve(u);
+
+    struct io_uring_sqe *sqe = uring_prepare(u, IORING_OP_SEND, r->fd, uc);
+    sqe->addr      = (unsigned long)data;
+    sqe->len       = size;
+    sqe->msg_flags = MSG_NOSIGNAL | response_more(&uc->body);
+    sqe->flags     = IOSQE_IO_LINK;
+    uc->operation  = URING_SEND;
+
+    /* A millisecond over, so the window has surely passed when it fires */
+    uring_link_timeout(u, uc, uc->since + SEND_TIMEOUT * 1000 - now + 1);
+    return 0;
+}
+
+/**
+ * Queue read of the next file chunk after any bytes in the output buffer.
+ *
+ * @param   u           Uring structure.
+ * @param   uc          UringConnection structure.
+ * @return  -1 on error and 0 on success.
+ **/
+static int uring_read(Uring *u, UringConnection *uc) {
+    Request *r    = uc->connection->request;
+    size_t   size = uc->body.length < URING_READ_SIZE ? uc->body.length : URING_READ_SIZE;
+    char    *space = buffer_reserve(&r->output, size);
+
+    if (!space) {
+        return -1;
+    }
+
+    struct io_uring_sqe *sqe = uring_prepare(u, IORING_OP_READ, uc->body.fd, uc);
+    sqe->addr     = (unsigned long)space;
+    sqe->len      = size;
+    sqe->off      = uc->body.offset;
+    uc->operation = URING_READ;
+    return 0;
+}
+
+static int uring_parse(Uring *u, int rfd, UringConnection *uc);
+
+/**
+ * Handle next pipelined request, or queue send of the buffered responses.
+ *
+ * @param   u           Uring structure.
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * This is called once the whole response to the current request is in the
+ * output buffer.  While complete requests are pipelined behind it, their
+ * responses are appended as well, so the batch goes out in one send.
+ **/
+static int uring_finish(Uring *u, int rfd, UringConnection *uc) {
+    Connection *c = uc->connection;
+
+    close_body(&uc->body);
+
+    if (connection_next(c) && c->request->input.length > 0 && connection_ready(c)) {
+        return uring_parse(u, rfd, uc);
+    }
+
+    return uring_send(u, uc);
+}
+
+/**
+ * Finish the buffered response.
+ *
+ * @param   u           Uring structure.
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * A file body attached by the handler is read through the ring like any
+ * other file.
+ **/
+static int uring_respond(Uring *u, int rfd, UringConnection *uc) {
+    Request *r = uc->connection->request;
+
+    if (r->body.fd >= 0 && r->body.length > 0) {
+        uc->body = r->body;
+        r->body  = (Body){.fd = -1};
+        return uring_read(u, uc);
+    }
+
+    return uring_finish(u, rfd, uc);
+}
+
+/**
+ * Parse buffered request and dispatch it, or queue open of the requested file.
+ *
+ * @param   u           Uring structure.
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * While the file cache is enabled, every request is dispatched straight away,
+ * so a miss is loaded into the cache by file_cache_get as in the other modes,
+ * and later requests find the file open and its metadata (and sidecars)
+ * known.  Otherwise, the file is opened beneath RootPath by the kernel
+ * (RESOLVE_BENEATH), which stands in for the realpath security check of
+ * determine_request_path, unless the request may negotiate an encoding.
+ **/
+static int uring_parse(Uring *u, int rfd, UringConnection *uc) {
+    Connection *c = uc->connection;
+    Request    *r = c->request;
+
+    /* Request is in: stop its deadline and start counting bytes sent */
+    uc->deadline = 0;
+    uc->since    = timer_now();
+    c->sent      = 0;
+
+    if (parse_request(r) < 0) {
+        fprintf(stderr, "parse_request failed\n");
+        r->keepalive = false;
+        handle_error(r, HTTP_STATUS_BAD_REQUEST);
+        return uring_respond(u, rfd, uc);
+    }
+
+    if (FileCacheEntries > 0 || request_header(r, HEADER_ACCEPT_ENCODING)) {
+        dispatch_request(r);
+        return uring_respond(u, rfd, uc);
+    }
+
+    const char *relative = r->uri + strspn(r->uri, "/");
+    if (*relative == 0) {
+        relative = ".";
+    }
+
+    uc->how.flags   = O_RDONLY | O_CLOEXEC;
+    uc->how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+
+    struct io_uring_sqe *sqe = uring_prepare(u, IORING_OP_OPENAT2, rfd, uc);
+    sqe->addr     = (unsigned long)relative;
+    sqe->len      = sizeof(struct open_how);
+    sqe->off      = (unsigned long)&uc->how;
+    uc->operation = URING_OPEN;
+    return 0;
+}
+
+/**
+ * Return whether opened file is negotiable, as handle_file_request sees it.
+ *
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @param   mimetype    Content-Type of file.
+ * @return  Whether response must carry Vary: Accept-Encoding.
+ *
+ * A file is negotiable if it may be compressed on the fly, or if a sidecar
+ * sits next to it.  The sidecar is not checked for staleness, since an
+ * extra Vary header is harmless and a missing one is not.
+ **/
+static bool uring_negotiable(int rfd, UringConnection *uc, const char *mimetype) {
+    Request    *r        = uc->connection->request;
+    const char *relative = r->uri + strspn(r->uri, "/");
+
+    if (encoding_sidecar(relative)) {
+        return false;
+    }
+    if (compress_eligible(mimetype, uc->stat.stx_size)) {
+        return true;
+    }
+
+    for (Encoding e = 0; e < ENCODINGS; e++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s%s", relative, encoding_suffix(e)) >= (int)sizeof(path)) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(rfd, path, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Serve opened file, or fall back to the synchronous handlers.
+ *
+ * @param   u           Uring structure.
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Only readable, non-executable regular files are streamed through the ring;
+ * directory listings and CGI scripts are dispatched as usual.  The client
+ * sent no Accept-Encoding, so the file goes out as is, but with Vary like
+ * handle_file_request if it has other encodings.
+ **/
+static int uring_serve(Uring *u, int rfd, UringConnection *uc) {
+    Request *r = uc->connection->request;
+
+    if (!S_ISREG(uc->stat.stx_mode) || (uc->stat.stx_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+        close_body(&uc->body);
+
+        dispatch_request(r);
+        return uring_respond(u, rfd, uc);
+    }
+
+    log("HTTP REQUEST TYPE: FILE");
+    const char *mimetype = determine_mimetype(r->uri);
+    Encoding    encoding = uring_negotiable(rfd, uc, mimetype) ? ENCODING_IDENTITY : ENCODING_NONE;
+    response_start_encoded(r, HTTP_STATUS_OK, mimetype, uc->stat.stx_size, encoding);
+    response_send(r);
+
+    uc->body.offset = 0;
+    uc->body.length = uc->stat.stx_size;
+    if (uc->body.length == 0) {
+        return uring_finish(u, rfd, uc);
+    }
+
+    return uring_read(u, uc);
+}
+
+/**
+ * Receive or handle next request of a persistent connection.
+ *
+ * @param   u           Uring structure.
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @return  -1 if the connection should be freed and 0 otherwise.
+ **/
+static int uring_next(Uring *u, int rfd, UringConnection *uc) {
+    Connection *c = uc->connection;
+
+    if (!connection_ready(c)) {
+        return uring_recv(u, uc);
+    }
+
+    if (c->request->input.length == 0) {
+        return -1;
+    }
+
+    return uring_parse(u, rfd, uc);
+}
+
+/**
+ * Advance connection state machine after an operation completes.
+ *
+ * @param   u           Uring structure.
+ * @param   rfd         Root directory file descriptor.
+ * @param   uc          UringConnection structure.
+ * @param   result      Result of completed operation.
+ *
+ * The connection is freed once its response has been sent (unless it
+ * persists), when its client closes, idles, misses its request
+ * deadline or reads too slowly, or on error.
+ **/
+static void uring_complete(Uring *u, int rfd, UringConnection *uc, int result) {
+    Connection *c = uc->connection;
+
+    switch (uc->operation) {
+        case URING_RECV:
+            if (result < 0) {
+                goto free;
+            }
+            if (result == 0) {
+                c->eof = true;
+            }
+            buffer_commit(&c->request->input, result);
+
+            if (!connection_ready(c)) {
+                if (uring_recv(u, uc) < 0) {
+                    goto free;
+                }
+            } else if (c->request->input.length == 0 || uring_parse(u, rfd, uc) < 0) {
+                goto free;
+            }
+            break;
+
+        case URING_OPEN:
+            if (result < 0) {
+                debug("openat2 failed: %s", strerror(-result));
+                handle_error(c->request, HTTP_STATUS_NOT_FOUND);
+                if (uring_respond(u, rfd, uc) < 0) {
+                    goto free;
+                }
+                break;
+            }
+            uc->body.fd = result;
+
+            struct io_uring_sqe *sqe = uring_prepare(u, IORING_OP_STATX, uc->body.fd, uc);
+            sqe->addr        = (unsigned long)"";
+            sqe->len         = STATX_TYPE | STATX_MODE | STATX_SIZE;
+            sqe->off         = (unsigned long)&uc->stat;
+            sqe->statx_flags = AT_EMPTY_PATH;
+            uc->operation    = URING_STATX;
+            break;
+
+        case URING_STATX:
+            if (result < 0) {
+                handle_error(c->request, HTTP_STATUS_NOT_FOUND);
+                if (uring_respond(u, rfd, uc) < 0) {
+                    goto free;
+                }
+            } else if (uring_serve(u, rfd, uc) < 0) {
+                goto free;
+            }
+            break;
+
+        case URING_READ:
+            if (result <= 0) {
+                goto free;
+            }
+            buffer_commit(&c->request->output, result);
+            uc->body.offset += result;
+            uc->body.length -= result;
+
+            if (uc->body.length > 0) {
+                if (uring_send(u, uc) < 0) {
+                    goto free;
+                }
+            } else if (uring_finish(u, rfd, uc) < 0) {
+                goto free;
+            }
+            break;
+
+        case URING_SEND:
+            if (result == -ECANCELED) {         /* Window ended: check rate */
+                if (uring_send(u, uc) < 0) {
+                    goto free;
+                }
+                break;
+            }
+            if (result < 0) {
+                goto free;
+            }
+            buffer_consume(&c->request->output, result);
+            c->sent += result;
+
+            if (c->request->output.length > 0) {
+                if (uring_send(u, uc) < 0) {
+                    goto free;
+                }
+            } else if (uc->body.length > 0) {
+                if (uring_read(u, uc) < 0) {
+                    goto free;
+                }
+            } else if (!c->persist || uring_next(u, rfd, uc) < 0) {
+                goto free;
+            }
+            break;
+    }
+
+    return;
+
+free:
+    uring_connection_free(u, uc);
+}
+
+/**
+ * Serve HTTP requests with asynchronous I/O submitted through io_uring.
+ *
+ * @param   sfd         Server socket file descriptor.
+ * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Accepts, receives, file reads, and sends are all queued as ring operations
+ * (and file opens and stats too, if the file cache is disabled); each pass
+ * over the completions queues the next operation of every connection and
+ * submits them together with one io_uring_enter.  Files are loaded by the
+ * file cache, and directory listings and CGI scripts run, synchronously
+ * within the loop.
+ **/
+int uring_server(int sfd) {
+    Uring u;
+    struct sockaddr_storage raddr;
+    socklen_t rlen = sizeof(raddr);
+
+    /* Open root directory that requested files are resolved beneath */
+    int rfd = open(RootPath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rfd < 0) {
+        fprintf(stderr, "open failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (uring_init(&u, URING_ENTRIES) < 0) {
+        close(rfd);
+        return EXIT_FAILURE;
+    }
+
+    /* Queue first accept (identified by NULL user data) */
+    struct io_uring_sqe *sqe = uring_prepare(&u, IORING_OP_ACCEPT, sfd, NULL);
+    sqe->addr         = (unsigned long)&raddr;
+    sqe->addr2        = (unsigned long)&rlen;
+    sqe->accept_flags = SOCK_CLOEXEC;
+
+    /* Submit queued operations and dispatch completions */
+    while (uring_submit(&u, 1) == 0) {
+        unsigned head = *u.cq_head;
+        unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+            UringConnection *uc = (UringConnection *)(unsigned long)cqe->user_data;
+            int result = cqe->res;
+
+            if (cqe->user_data == URING_TIMEOUT) {
+                continue;
+            }
+
+            if (uc) {
+                uring_complete(&u, rfd, uc, result);
+                continue;
+            }
+
+            /* Accept completed: start receiving and queue next accept */
+            if (result >= 0) {
+                Connection *c = connection_create(result, (struct sockaddr *)&raddr, rlen);
+                uc = c ? calloc(1, sizeof(UringConnection)) : NULL;
+                if (uc) {
+                    uc->connection = c;
+                    uc->body.fd    = -1;
+                    if (uring_recv(&u, uc) < 0) {
+                        uring_connection_free(&u, uc);
+                    }
+                } else {
+                    connection_free(c);
+                }
+            } else {
+                fprintf(stderr, "accept failed: %s\n", strerror(-result));
+            }
+
+            rlen = sizeof(raddr);
+            sqe  = uring_prepare(&u, IORING_OP_ACCEPT, sfd, NULL);
+            sqe->addr         = (unsigned long)&raddr;
+            sqe->addr2        = (unsigned long)&rlen;
+            sqe->accept_flags = SOCK_CLOEXEC;
+        }
+
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    close(u.fd);
+    close(rfd);
+    close(sfd);
+    return EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -9,100 +9,33 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-/**
- * Determine mime-type from file extension.
- *
- * @param   path        Path to file.
- * @return  An allocated string containing the mime-type of the specified file.
- *
- * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
- *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
- * following format:
- *
- *  <MIMETYPE>      <EXT1> <EXT2> ...
- *
- * This function simply checks the file extension version each extension for
- * each mimetype and returns the mimetype on the first match.
- *
- * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
- *
- * This function returns an allocated string that must be free'd.
- **/
-char * determine_mimetype(const char *path) {
-    char *ext;
-    char *mimetype;
-    char *token;
-    char buffer[BUFSIZ];
-    FILE *fs = NULL;
-
-    /* Find file extension */
-    ext = strchr(path, '.');
-    if(ext == NULL){
-        fprintf(stderr, "strchr on ext failed");
-        goto fail;
-    }
-    ext++; // We must move the pointer past the . to only get the characters of the ext
-
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath, "r");
-    if(fs == NULL){
-         fprintf(stderr, "fopen mimetypespath failed: %s\n", strerror(errno));
-         goto fail;
-    }
-
-    /* Scan file for matching file extensions */
-    while(fgets(buffer, BUFSIZ, fs)){
-        chomp(buffer);
-        mimetype = strtok(buffer, WHITESPACE);
-        if(mimetype == NULL){
-            continue; 
-        }
-        while((token = strtok(NULL, WHITESPACE))){
-            if(streq(ext, token)){
-                 goto done;
-            }
-        }
-    }
-    
-fail:
-    mimetype = DefaultMimeType;
-
-done:
-    fclose(fs);
-    return strdup(mimetype);
-}
-
 /**
  * Determine actual filesystem path based on RootPath and URI.
  *
  * @param   uri         Resource path of URI.
- * @return  An allocated string containing the full path of the resource on the
- * local filesystem.
+ * @param   buffer      Buffer of PATH_MAX bytes for the path.
+ * @return  buffer containing the full path of the resource on the local
+ * filesystem (or NULL if it does not exist).
  *
  * This function uses realpath(3) to generate the realpath of the
  * file requested in the URI.
  *
  * As a security check, if the real path does not begin with the RootPath, then
  * return NULL.
- *
- * Otherwise, return a newly allocated string containing the real path.  This
- * string must later be free'd.
  **/
-char * determine_request_path(const char *uri) {
-    char realpt[BUFSIZ];
+char * determine_request_path(const char *uri, char *buffer) {
     char catbuf[BUFSIZ];
     snprintf(catbuf, BUFSIZ, "%s/%s", RootPath, uri);
     
-    realpath(catbuf, realpt);
+    if(realpath(catbuf, buffer) == NULL){
+        return NULL;
+    }
     
-    if(strncmp(RootPath, realpt, strlen(RootPath)) != 0){
+    if(strncmp(RootPath, buffer, strlen(RootPath)) != 0){
         return NULL;
     }
     
-    return strdup(realpt);
+    return buffer;
 }
 
 /**
@@ -119,6 +52,7 @@ const char * http_status_string(Status status) {
         "400 Bad Request",
         "404 Not Found",
         "500 Internal Server Error",
+        "502 Bad Gateway",
         "418 I'm A Teapot",
     };
 
@@ -0,0 +1,473 @@
+/* watch.c: Document Root Watcher */
+
+#define _GNU_SOURCE
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+
+/* Constants */
+
+#define WATCH_MASK      (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+                         IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_NAMESPACE (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Root Watcher */
+
+typedef struct {
+    char           *prefix;             /*< Paths subscriber caches */
+    size_t          length;             /*< Number of bytes in prefix */
+    WatchHandler    handler;            /*< Called with each changed path */
+    void           *arg;                /*< Passed to handler */
+} WatchSubscriber;
+
+typedef struct {
+    char           *path;               /*< Changed path */
+    bool            recursive;          /*< Whether everything beneath path changed too */
+} WatchChange;
+
+typedef struct {
+    int             fd;                 /*< Inotify file descriptor (or -1) */
+    char           *root;               /*< Watched directory tree */
+    bool            active;             /*< Whether changes are being posted (atomic) */
+
+    char          **directories;        /*< Path of each watched directory (indexed by wd) */
+    size_t          ndirectories;       /*< Number of slots in directories */
+
+    WatchChange    *batch;              /*< Changes not yet posted */
+    size_t          nbatch;             /*< Number of paths in batch */
+    bool            overflow;           /*< Whether batch stands for the whole root */
+
+    WatchSubscriber subscribers[WATCH_SUBSCRIBERS_MAX];
+    size_t          nsubscribers;       /*< Number of subscribers */
+    pthread_mutex_t lock;               /*< Protects subscribers */
+} Watcher;
+
+static Watcher Watch = {
+    .fd   = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Internal Functions */
+
+/**
+ * Return whether path is base or lies beneath it.
+ *
+ * @param   path        Absolute path.
+ * @param   base        Absolute path of directory.
+ * @param   length      Number of bytes in base.
+ **/
+static bool watch_beneath(const char *path, const char *base, size_t length) {
+    return strncmp(path, base, length) == 0 && (path[length] == '\0' || path[length] == '/');
+}
+
+/**
+ * Compare changes so every path sorts right before those beneath it.
+ *
+ * @param   a           Pointer to first WatchChange.
+ * @param   b           Pointer to second WatchChange.
+ * @return  Negative, zero, or positive like strcmp.
+ *
+ * A '/' sorts before any other character, which keeps "a", "a/b" and "a/c"
+ * together ahead of "a.txt".  Of two changes to the same path, the recursive
+ * one comes first.
+ **/
+static int watch_compare(const void *a, const void *b) {
+    const WatchChange   *x = a;
+    const WatchChange   *y = b;
+    const unsigned char *s = (const unsigned char *)x->path;
+    const unsigned char *t = (const unsigned char *)y->path;
+
+    while (*s && *s == *t) {
+        s++;
+        t++;
+    }
+
+    int c = *s == '/' ? 1 : *s;
+    int d = *t == '/' ? 1 : *t;
+    return c != d ? c - d : y->recursive - x->recursive;
+}
+
+/**
+ * Watch directory and every directory beneath it.
+ *
+ * @param   path        Path of directory.
+ *
+ * Symbolic links are not followed.  A directory that cannot be watched (ie.
+ * the watch limit is reached) is logged and skipped, so entries beneath it
+ * are only dropped when an ancestor changes.
+ **/
+static void watch_add(const char *path) {
+    int wd = inotify_add_watch(Watch.fd, path, WATCH_MASK);
+    if (wd < 0) {
+        log("inotify_add_watch %s failed: %s", path, strerror(errno));
+        return;
+    }
+
+    if ((size_t)wd >= Watch.ndirectories) {
+        size_t ndirectories = Watch.ndirectories ? Watch.ndirectories : 64;
+        while (ndirectories <= (size_t)wd) {
+            ndirectories *= 2;
+        }
+
+        char **directories = realloc(Watch.directories, ndirectories * sizeof(char *));
+        if (!directories) {
+            inotify_rm_watch(Watch.fd, wd);
+            return;
+        }
+        memset(directories + Watch.ndirectories, 0, (ndirectories - Watch.ndirectories) * sizeof(char *));
+        Watch.directories  = directories;
+        Watch.ndirectories = ndirectories;
+    }
+
+    free(Watch.directories[wd]);
+    Watch.directories[wd] = strdup(path);
+
+    DIR *d = opendir(path);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (streq(e->d_name, ".") || streq(e->d_name, "..")) {
+            continue;
+        }
+
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, e->d_name) >= (int)sizeof(child)) {
+            continue;
+        }
+
+        struct stat st;
+        if (e->d_type == DT_DIR || (e->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            watch_add(child);
+        }
+    }
+
+    closedir(d);
+}
+
+/**
+ * Stop watching directory and every directory beneath it.
+ *
+ * @param   path        Path of directory (moved away).
+ *
+ * Slots are freed once the kernel confirms each removal with IN_IGNORED.
+ **/
+static void watch_remove(const char *path) {
+    size_t length = strlen(path);
+
+    for (size_t wd = 0; wd < Watch.ndirectories; wd++) {
+        if (Watch.directories[wd] && watch_beneath(Watch.directories[wd], path, length)) {
+            inotify_rm_watch(Watch.fd, wd);
+        }
+    }
+}
+
+/**
+ * Drop batch in favour of posting the whole root.
+ **/
+static void watch_overflow(void) {
+    for (size_t i = 0; i < Watch.nbatch; i++) {
+        free(Watch.batch[i].path);
+    }
+    Watch.nbatch   = 0;
+    Watch.overflow = true;
+}
+
+/**
+ * Add changed path to batch.
+ *
+ * @param   path        Changed path.
+ * @param   recursive   Whether everything beneath path changed too.
+ *
+ * A change repeating the last one (ie. a file written in many chunks) is only
+ * added once.  Past WATCH_BATCH_MAX paths, the batch is dropped in favour of
+ * posting the whole root, so a large deploy costs one full invalidation
+ * instead of thousands of small ones.
+ **/
+static void watch_queue(const char *path, bool recursive) {
+    if (Watch.overflow) {
+        return;
+    }
+    if (Watch.nbatch > 0 && Watch.batch[Watch.nbatch - 1].recursive == recursive &&
+        streq(Watch.batch[Watch.nbatch - 1].path, path)) {
+        return;
+    }
+
+    char *copy = Watch.nbatch < WATCH_BATCH_MAX ? strdup(path) : NULL;
+    if (!copy) {
+        watch_overflow();
+        return;
+    }
+
+    Watch.batch[Watch.nbatch++] = (WatchChange){copy, recursive};
+}
+
+/**
+ * Handle inotify event.
+ *
+ * @param   event       Inotify event.
+ *
+ * The path named by the event is queued, along with its directory when an
+ * entry is created, deleted, or moved (since its listing changed).  A
+ * directory that appears, disappears, or moves changes everything beneath it
+ * as well.  New directories are watched as they appear.
+ **/
+static void watch_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        debug("inotify queue overflowed");
+        watch_overflow();
+        return;
+    }
+
+    if (event->wd < 0 || (size_t)event->wd >= Watch.ndirectories || !Watch.directories[event->wd]) {
+        return;
+    }
+
+    char *directory = Watch.directories[event->wd];
+    if (event->mask & IN_IGNORED) {
+        free(directory);
+        Watch.directories[event->wd] = NULL;
+        return;
+    }
+
+    char path[PATH_MAX];
+    if (event->len == 0) {
+        watch_queue(directory, event->mask & (IN_DELETE_SELF | IN_MOVE_SELF));
+        return;
+    }
+    if (snprintf(path, sizeof(path), "%s/%s", directory, event->name) >= (int)sizeof(path)) {
+        watch_queue(directory, true);
+        return;
+    }
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_add(path);
+        } else if (event->mask & IN_MOVED_FROM) {
+            watch_remove(path);
+        }
+    }
+
+    watch_queue(path, (event->mask & IN_ISDIR) && (event->mask & WATCH_NAMESPACE));
+    if (event->mask & WATCH_NAMESPACE) {
+        watch_queue(directory, false);
+    }
+}
+
+/**
+ * Post batch of changes to subscribers.
+ *
+ * The batch is sorted so that duplicates, and paths beneath a recursive
+ * change, are dropped.  Each remaining change goes to every subscriber whose
+ * prefix the path is beneath (or, if recursive, contains).
+ **/
+static void watch_post(void) {
+    size_t nposted = 0;
+
+    if (Watch.overflow) {
+        Watch.batch[0] = (WatchChange){strdup(Watch.root), true};
+        Watch.nbatch   = Watch.batch[0].path ? 1 : 0;
+    }
+
+    qsort(Watch.batch, Watch.nbatch, sizeof(WatchChange), watch_compare);
+
+    pthread_mutex_lock(&Watch.lock);
+    const char *last      = NULL;     /* Last change posted */
+    const char *recursive = NULL;     /* Last recursive change posted */
+    for (size_t i = 0; i < Watch.nbatch; i++) {
+        const WatchChange *change = &Watch.batch[i];
+        if ((last && streq(change->path, last)) ||
+            (recursive && watch_beneath(change->path, recursive, strlen(recursive)))) {
+            continue;
+        }
+        last      = change->path;
+        recursive = change->recursive ? change->path : recursive;
+        nposted++;
+
+        size_t length = strlen(change->path);
+        for (size_t s = 0; s < Watch.nsubscribers; s++) {
+            WatchSubscriber *subscriber = &Watch.subscribers[s];
+            if (watch_beneath(change->path, subscriber->prefix, subscriber->length) ||
+                (change->recursive && watch_beneath(subscriber->prefix, change->path, length))) {
+                subscriber->handler(change->path, change->recursive, subscriber->arg);
+            }
+        }
+    }
+    pthread_mutex_unlock(&Watch.lock);
+
+    debug("Posted %zu of %zu changed paths%s", nposted, Watch.nbatch, Watch.overflow ? " (overflow)" : "");
+
+    for (size_t i = 0; i < Watch.nbatch; i++) {
+        free(Watch.batch[i].path);
+    }
+    Watch.nbatch   = 0;
+    Watch.overflow = false;
+}
+
+/**
+ * Read inotify events and post them to subscribers in batches.
+ *
+ * @param   arg         Unused.
+ * @return  NULL once the inotify descriptor fails.
+ *
+ * A batch is posted once no event has arrived for WATCH_QUIET_MS, or once its
+ * first event is WATCH_DELAY_MAX_MS old, whichever comes first.
+ **/
+static void * watch_run(void *arg) {
+    char     events[BUFSIZ] __attribute__((aligned(__alignof__(struct inotify_event))));
+    uint64_t first = 0;
+    uint64_t last  = 0;
+
+    while (true) {
+        int timeout = -1;
+        if (Watch.nbatch > 0 || Watch.overflow) {
+            uint64_t now   = timer_now();
+            uint64_t quiet = last + WATCH_QUIET_MS;
+            uint64_t due   = first + WATCH_DELAY_MAX_MS;
+            uint64_t at    = quiet < due ? quiet : due;
+            timeout = at > now ? (int)(at - now) : 0;
+        }
+
+        struct pollfd pfd = {.fd = Watch.fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            log("poll failed: %s", strerror(errno));
+            break;
+        }
+        if (ready == 0) {
+            watch_post();
+            continue;
+        }
+
+        ssize_t nread = read(Watch.fd, events, sizeof(events));
+        if (nread < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (nread <= 0) {
+            log("inotify read failed: %s", strerror(errno));
+            break;
+        }
+
+        uint64_t now = timer_now();
+        if (Watch.nbatch == 0 && !Watch.overflow) {
+            first = now;
+        }
+        last = now;
+
+        for (char *e = events; e < events + nread; ) {
+            const struct inotify_event *event = (const struct inotify_event *)e;
+            watch_event(event);
+            e += sizeof(struct inotify_event) + event->len;
+        }
+
+        if ((Watch.nbatch > 0 || Watch.overflow) && now - first >= WATCH_DELAY_MAX_MS) {
+            watch_post();
+        }
+    }
+
+    /* Caches fall back to trusting entries for a limited time */
+    __atomic_store_n(&Watch.active, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Watch Functions */
+
+/**
+ * Subscribe to changes beneath prefix.
+ *
+ * @param   prefix      Absolute path subscriber caches entries beneath.
+ * @param   handler     Called with each change (on the watcher thread).
+ * @param   arg         Passed to handler.
+ * @return  -1 on error and 0 on success.
+ *
+ * The handler drops its entry for the changed path, and if the change is
+ * recursive, every entry beneath it as well.  A directory changes by itself
+ * when an entry is added to or removed from it.  Subscriptions made before a fork are
+ * inherited by the child.
+ **/
+int watch_subscribe(const char *prefix, WatchHandler handler, void *arg) {
+    char *copy = strdup(prefix);
+    if (!copy) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&Watch.lock);
+    if (Watch.nsubscribers == WATCH_SUBSCRIBERS_MAX) {
+        pthread_mutex_unlock(&Watch.lock);
+        free(copy);
+        return -1;
+    }
+    Watch.subscribers[Watch.nsubscribers++] = (WatchSubscriber){copy, strlen(copy), handler, arg};
+    pthread_mutex_unlock(&Watch.lock);
+    return 0;
+}
+
+/**
+ * Watch directory tree in a thread of the calling process.
+ *
+ * @param   root        Path of directory to watch recursively.
+ * @return  -1 on error and 0 on success.
+ *
+ * Each process serving requests needs its own watcher, since its caches are
+ * its own; a watcher started before fork is not running in the child.
+ **/
+int watch_start(const char *root) {
+    Watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Watch.fd < 0) {
+        log("inotify_init1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    Watch.root  = strdup(root);
+    Watch.batch = calloc(WATCH_BATCH_MAX, sizeof(WatchChange));
+    if (!Watch.root || !Watch.batch) {
+        goto failure;
+    }
+
+    watch_add(root);
+    if (Watch.ndirectories == 0) {
+        goto failure;
+    }
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, watch_run, NULL);
+    if (error) {
+        log("pthread_create failed: %s", strerror(error));
+        goto failure;
+    }
+    pthread_detach(thread);
+    __atomic_store_n(&Watch.active, true, __ATOMIC_RELEASE);
+
+    debug("Watching %s", root);
+    return 0;
+
+failure:
+    close(Watch.fd);
+    Watch.fd = -1;
+    return -1;
+}
+
+/**
+ * Return whether changes beneath the root are being posted, so subscribers
+ * can trust their entries until told otherwise.
+ *
+ * This takes no lock, since subscribers call it with their own lock held.
+ **/
+bool watch_active(void) {
+    return __atomic_load_n(&Watch.active, __ATOMIC_ACQUIRE);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */